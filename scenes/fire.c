@@ -83,5 +83,7 @@ const fwpScene scene = {
     .reload = reload,
     .unload = unload,
     .event = event,
-    .tick = tick
+    .tick = tick,
+    // Each frame burns on from the last one
+    .keepFrame = 1
 };
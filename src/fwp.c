@@ -55,27 +55,111 @@
 #include <dlfcn.h>
 #endif
 
+// Flushing from a second thread needs a thread-safe backend, Cocoa only
+// allows drawing from the main thread so only X11 gets it for now
+#if defined(PLATFORM_LINUX)
+#define FWP_PIPELINED
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#endif
+
+#if defined(PLATFORM_LINUX)
+#include <sys/inotify.h>
+#endif
+
+#if !defined(PLATFORM_WINDOWS)
+#define FWP_RECORD
+#define FWP_LOADER
+#define FWP_JOBS
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <errno.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
 
 static struct {
 #if defined(PLATFORM_WINDOWS)
     FILETIME writeTime;
 #else
+    // The library is loaded again when its inode or modified time changes
     ino_t handleID;
+    long long handleTime;
+#endif
+#if defined(PLATFORM_LINUX)
+    // Watches the library's directory, -1 when inotify isn't available and
+    // it falls back to checking the inode every frame
+    struct {
+        int fd;
+        const char *name;
+        // Set after a failed load, the inode and modified time are checked as
+        // well until one works
+        int retry;
+    } watch;
 #endif
     void *handle;
     fwpState *state;
     fwpScene *scene;
     pbImage *buffer;
+#if defined(FWP_PIPELINED)
+    // Triple buffering: the scene draws into buffers[render], the present
+    // thread owns another and the mailbox holds the third, plus a flag
+    // saying whether it's a frame that hasn't been presented yet
+    struct {
+        pbImage *buffers[3];
+        // Numbers the frame in each buffer, so the present thread knows
+        // when frames were skipped and a buffer's dirty areas aren't enough
+        unsigned int frames[3], frame;
+        int render;
+        atomic_int mailbox, running;
+        sem_t ready;
+        pthread_t thread;
+    } pipeline;
+#endif
+#if defined(FWP_RECORD)
+    // Frames waiting to be written are copied into a fixed ring of images,
+    // when it's full new frames are dropped instead of stalling the loop
+    struct {
+        pbImage *slots[8];
+        int frames[8];
+        unsigned int head, tail;
+        int frame, dropped, failed, running;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_t thread;
+    } record;
+#endif
+#if defined(FWP_LOADER)
+    // Reloads are opened on another thread and swapped in by the main loop
+    struct {
+        void *handle;
+        fwpScene *scene;
+        // result is 1 when a library is waiting to be swapped in, -1 when
+        // loading failed, stale when the file changed since the last request
+        int result, busy, stale, running;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_t thread;
+    } loader;
+#endif
     struct {
         unsigned int width;
         unsigned int height;
         const char *title;
         pbFlags flags;
         char *path;
+        int pipelined;
+        double fps, fixed, eventBudget;
+        const char *record, *trace;
+        int bench, warmup, noFlush, threads;
     } args;
+    double accumulator;
 } state;
 
 static struct option long_options[] = {
@@ -86,6 +170,18 @@ static struct option long_options[] = {
     {"top", no_argument, NULL, 'a'},
     {"usage", no_argument, NULL, 'u'},
     {"path", required_argument, NULL, 'p'},
+    {"pipelined", no_argument, NULL, 'P'},
+    {"fps", required_argument, NULL, 'f'},
+    {"fixed", required_argument, NULL, 'F'},
+    {"coalesce", no_argument, NULL, 'c'},
+    {"event-budget", required_argument, NULL, 'e'},
+    {"record", required_argument, NULL, 'R'},
+    {"profile", no_argument, NULL, 'O'},
+    {"trace", required_argument, NULL, 'T'},
+    {"bench", required_argument, NULL, 'B'},
+    {"warmup", required_argument, NULL, 'W'},
+    {"no-flush", no_argument, NULL, 'N'},
+    {"threads", required_argument, NULL, 'j'},
     {NULL, 0, NULL, 0}
 };
 
@@ -103,9 +199,356 @@ static void usage(void) {
     puts("      -t/--title     Window title [default: \"fwp\"]");
     puts("      -r/--resizable Enable resizable window");
     puts("      -a/--top       Enable window always on top");
+    puts("      -P/--pipelined Present frames on a separate thread");
+    puts("      -f/--fps       Frame rate cap, 0 to disable [default: 60]");
+    puts("      -F/--fixed     Tick the scene this many times a second with a");
+    puts("                     fixed delta instead of once per frame");
+    puts("      -c/--coalesce  Merge mouse motion into one event per frame");
+    puts("      -e/--event-budget Milliseconds per frame to spend on events,");
+    puts("                     0 to handle every queued event [default: 0]");
+    puts("      -R/--record    Write every frame to this directory as QOI");
+    puts("      -O/--profile   Show the frame profiler, F3 toggles it");
+    puts("      -T/--trace     Write a Chrome/Perfetto trace to this file on exit");
+    puts("      -B/--bench     Run this many frames as fast as possible and print");
+    puts("                     frame time statistics");
+    puts("      -W/--warmup    Frames to run before --bench starts timing [default: 0]");
+    puts("      -N/--no-flush  Don't present frames during --bench");
+    puts("      -j/--threads   Threads for scene jobs, main thread included");
+    puts("                     [default: number of CPUs]");
     puts("      -u/--usage     Display this message");
 }
 
+// Every thread that reports events gets its own buffer, only that thread
+// writes to it so recording doesn't need a lock. Buffers are pushed onto a
+// list the first time a thread records something and written out at exit
+#define FWP_TRACE_CHUNK 4096
+#define FWP_TRACE_MAX_CHUNKS 256
+
+typedef struct fwpTraceChunk {
+    struct fwpTraceChunk *next;
+    int count;
+    struct {
+        char name[24];
+        double start, end;
+    } events[FWP_TRACE_CHUNK];
+} fwpTraceChunk;
+
+typedef struct fwpTraceBuffer {
+    struct fwpTraceBuffer *next;
+    char thread[24];
+    int id, chunks, dropped;
+    fwpTraceChunk *first, *last;
+} fwpTraceBuffer;
+
+static _Atomic(fwpTraceBuffer*) traceBuffers = NULL;
+static atomic_int traceThreads = 0;
+static _Thread_local fwpTraceBuffer *traceLocal = NULL;
+
+static fwpTraceBuffer* TraceBuffer(const char *thread) {
+    fwpTraceBuffer *buffer = traceLocal;
+    if (buffer)
+        return buffer;
+    if (!(buffer = calloc(1, sizeof(fwpTraceBuffer))))
+        return NULL;
+    buffer->id = atomic_fetch_add(&traceThreads, 1);
+    if (thread)
+        strncpy(buffer->thread, thread, sizeof(buffer->thread) - 1);
+    else
+        snprintf(buffer->thread, sizeof(buffer->thread), "thread %d", buffer->id);
+    buffer->next = atomic_load(&traceBuffers);
+    while (!atomic_compare_exchange_weak(&traceBuffers, &buffer->next, buffer))
+        ;
+    return traceLocal = buffer;
+}
+
+// Names the calling thread in the trace, call before it records anything
+static void TraceThread(const char *name) {
+    if (state.args.trace)
+        TraceBuffer(name);
+}
+
+static void TraceEvent(const char *name, double start, double end) {
+    fwpTraceBuffer *buffer;
+    if (!state.args.trace || !(buffer = TraceBuffer(NULL)))
+        return;
+    fwpTraceChunk *chunk = buffer->last;
+    if (!chunk || chunk->count == FWP_TRACE_CHUNK) {
+        if (buffer->chunks == FWP_TRACE_MAX_CHUNKS || !(chunk = calloc(1, sizeof(fwpTraceChunk)))) {
+            buffer->dropped++;
+            return;
+        }
+        if (buffer->last)
+            buffer->last->next = chunk;
+        else
+            buffer->first = chunk;
+        buffer->last = chunk;
+        buffer->chunks++;
+    }
+    strncpy(chunk->events[chunk->count].name, name, sizeof(chunk->events[0].name) - 1);
+    chunk->events[chunk->count].start = start;
+    chunk->events[chunk->count].end = end;
+    chunk->count++;
+}
+
+static void TraceString(FILE *fh, const char *str) {
+    fputc('"', fh);
+    for (; *str; str++)
+        if (*str == '"' || *str == '\\')
+            fprintf(fh, "\\%c", *str);
+        else if ((unsigned char)*str >= ' ')
+            fputc(*str, fh);
+    fputc('"', fh);
+}
+
+// Writes everything in the Trace Event format (chrome://tracing, Perfetto).
+// Every other thread has to be finished with recording by now
+static void EndTrace(void) {
+    FILE *fh = fopen(state.args.trace, "w");
+    if (!fh)
+        printf("ERROR: Failed to open \"%s\"\n", state.args.trace);
+    else
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fh);
+    int first = 1, dropped = 0;
+    fwpTraceBuffer *buffer = atomic_exchange(&traceBuffers, NULL);
+    while (buffer) {
+        if (fh) {
+            fprintf(fh, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", buffer->id);
+            TraceString(fh, buffer->thread);
+            fputs("}}", fh);
+            first = 0;
+        }
+        for (fwpTraceChunk *chunk = buffer->first, *next; chunk; chunk = next) {
+            for (int i = 0; fh && i < chunk->count; i++) {
+                fputs(",\n{\"ph\":\"X\",\"cat\":\"fwp\",\"name\":", fh);
+                TraceString(fh, chunk->events[i].name);
+                fprintf(fh, ",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", buffer->id, chunk->events[i].start * 1e6, (chunk->events[i].end - chunk->events[i].start) * 1e6);
+            }
+            next = chunk->next;
+            free(chunk);
+        }
+        dropped += buffer->dropped;
+        fwpTraceBuffer *next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+    if (fh) {
+        fputs("\n]}\n", fh);
+        fclose(fh);
+        printf("Wrote trace to \"%s\"", state.args.trace);
+        if (dropped)
+            printf(", %d events dropped", dropped);
+        puts("");
+    }
+}
+
+#if defined(FWP_JOBS)
+#define FWP_DEQUE_SIZE 1024
+#define FWP_MAX_THREADS 64
+
+struct pbTask {
+    pbJob job;
+    void *userdata;
+    atomic_int remaining;
+};
+
+// Jobs [begin, end) of a task
+typedef struct {
+    struct pbTask *task;
+    int begin, end;
+} fwpWork;
+
+// Deque 0 is shared by every thread outside the pool (the main loop
+// included), the others belong to one worker each. Owners push and pop at
+// the bottom, thieves take from the top where the oldest, biggest ranges are
+typedef struct {
+    atomic_flag lock;
+    unsigned int top, bottom;
+    fwpWork items[FWP_DEQUE_SIZE];
+} fwpDeque;
+
+static struct {
+    int threads;
+    fwpDeque *deques;
+    pthread_t workers[FWP_MAX_THREADS];
+    atomic_int queued, sleeping, running;
+    // Jobs not yet finished across every task, waited or not
+    atomic_int outstanding;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} pool;
+
+static _Thread_local int poolIndex = 0;
+
+static void LockDeque(fwpDeque *deque) {
+    while (atomic_flag_test_and_set_explicit(&deque->lock, memory_order_acquire))
+        ;
+}
+
+static void UnlockDeque(fwpDeque *deque) {
+    atomic_flag_clear_explicit(&deque->lock, memory_order_release);
+}
+
+static int PushWork(fwpWork work) {
+    fwpDeque *deque = &pool.deques[poolIndex];
+    LockDeque(deque);
+    int pushed = deque->bottom - deque->top < FWP_DEQUE_SIZE;
+    if (pushed) {
+        deque->items[deque->bottom++ % FWP_DEQUE_SIZE] = work;
+        atomic_fetch_add(&pool.queued, 1);
+    }
+    UnlockDeque(deque);
+    // Workers bump sleeping before checking queued, so one side always sees
+    // the other and a push can't slip past a worker going to sleep
+    if (pushed && atomic_load(&pool.sleeping)) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_signal(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return pushed;
+}
+
+static int TakeWork(fwpWork *work) {
+    for (int i = 0; i < pool.threads; i++) {
+        int victim = (poolIndex + i) % pool.threads;
+        fwpDeque *deque = &pool.deques[victim];
+        LockDeque(deque);
+        int found = deque->bottom != deque->top;
+        if (found) {
+            *work = victim == poolIndex ? deque->items[--deque->bottom % FWP_DEQUE_SIZE] : deque->items[deque->top++ % FWP_DEQUE_SIZE];
+            atomic_fetch_sub(&pool.queued, 1);
+        }
+        UnlockDeque(deque);
+        if (found)
+            return 1;
+    }
+    return 0;
+}
+
+static void RunWork(fwpWork work) {
+    // Keep splitting off the upper half for others to steal, if nobody does
+    // the halves come back off our own deque in order
+    while (work.end - work.begin > 1) {
+        int middle = work.begin + (work.end - work.begin) / 2;
+        if (!PushWork((fwpWork) { work.task, middle, work.end }))
+            break;
+        work.end = middle;
+    }
+    for (int i = work.begin; i < work.end; i++)
+        work.task->job(work.task->userdata, i);
+    int done = work.end - work.begin;
+    // The task may be freed as soon as remaining hits zero
+    atomic_fetch_sub_explicit(&work.task->remaining, done, memory_order_release);
+    atomic_fetch_sub_explicit(&pool.outstanding, done, memory_order_release);
+}
+
+// Waiting threads run other work instead of blocking, which is also what
+// makes nested pbParallelFor calls from inside jobs safe
+static void HelpUntilDone(struct pbTask *task) {
+    fwpWork work;
+    while (atomic_load_explicit(&task->remaining, memory_order_acquire) > 0)
+        if (TakeWork(&work))
+            RunWork(work);
+        else
+            sched_yield();
+}
+
+static void* PoolWorker(void *arg) {
+    char name[24];
+    poolIndex = (int)(intptr_t)arg;
+    snprintf(name, sizeof(name), "worker %d", poolIndex);
+    TraceThread(name);
+    fwpWork work;
+    while (atomic_load(&pool.running)) {
+        if (TakeWork(&work)) {
+            RunWork(work);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        atomic_fetch_add(&pool.sleeping, 1);
+        while (!atomic_load(&pool.queued) && atomic_load(&pool.running))
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        atomic_fetch_sub(&pool.sleeping, 1);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+static void PoolParallelFor(pbJob job, void *userdata, int count) {
+    struct pbTask task = { .job = job, .userdata = userdata };
+    atomic_init(&task.remaining, count);
+    atomic_fetch_add(&pool.outstanding, count);
+    RunWork((fwpWork) { &task, 0, count });
+    HelpUntilDone(&task);
+}
+
+static pbTask* PoolSpawn(int count, pbJob job, void *userdata) {
+    struct pbTask *task = malloc(sizeof(struct pbTask));
+    if (!task) {
+        pbParallelFor(count, job, userdata);
+        return NULL;
+    }
+    task->job = job;
+    task->userdata = userdata;
+    atomic_init(&task->remaining, count > 0 ? count : 0);
+    if (count > 0)
+        atomic_fetch_add(&pool.outstanding, count);
+    if (count > 0 && !PushWork((fwpWork) { task, 0, count }))
+        RunWork((fwpWork) { task, 0, count });
+    return task;
+}
+
+static void PoolWait(pbTask *task) {
+    HelpUntilDone(task);
+    free(task);
+}
+
+// Runs and waits for everything in flight, including tasks the scene spawned
+// and never waited on, so none of its code is left running when it unloads
+static void DrainPool(void) {
+    fwpWork work;
+    while (atomic_load_explicit(&pool.outstanding, memory_order_acquire) > 0)
+        if (TakeWork(&work))
+            RunWork(work);
+        else
+            sched_yield();
+}
+
+static int BeginPool(void) {
+    if (!state.args.threads)
+        state.args.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    pool.threads = state.args.threads < 1 ? 1 : state.args.threads > FWP_MAX_THREADS ? FWP_MAX_THREADS : state.args.threads;
+    if (!(pool.deques = calloc(pool.threads, sizeof(fwpDeque))))
+        return 0;
+    for (int i = 0; i < pool.threads; i++)
+        atomic_flag_clear(&pool.deques[i].lock);
+    atomic_store(&pool.running, 1);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    for (int i = 1; i < pool.threads; i++)
+        if (pthread_create(&pool.workers[i], NULL, PoolWorker, (void*)(intptr_t)i)) {
+            pool.threads = i;
+            break;
+        }
+    pbSetDispatcher(PoolParallelFor);
+    pbSetTaskSystem(PoolSpawn, PoolWait);
+    return 1;
+}
+
+static void EndPool(void) {
+    pbSetDispatcher(NULL);
+    pbSetTaskSystem(NULL, NULL);
+    pthread_mutex_lock(&pool.lock);
+    atomic_store(&pool.running, 0);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.threads; i++)
+        pthread_join(pool.workers[i], NULL);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.deques);
+}
+#endif
+
 #if defined(PLATFORM_WINDOWS)
 static FILETIME Win32GetLastWriteTime(char* path) {
     FILETIME time;
@@ -118,7 +561,51 @@ static FILETIME Win32GetLastWriteTime(char* path) {
 }
 #endif
 
-static int ShouldReloadLibrary(void) {
+#if defined(PLATFORM_LINUX)
+static void BeginWatch(void) {
+    char *dir = strdup(state.args.path);
+    char *slash = strrchr(dir, '/');
+    state.watch.name = state.args.path + (slash - dir) + 1;
+    if (slash == dir)
+        slash++;
+    *slash = '\0';
+    // Only react once the file has been completely written or moved into
+    // place, so a half-written library is never loaded
+    if ((state.watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+        inotify_add_watch(state.watch.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(state.watch.fd);
+        state.watch.fd = -1;
+    }
+    free(dir);
+}
+
+static int WatchedLibraryChanged(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t length;
+    while ((length = read(state.watch.fd, buf, sizeof(buf))) > 0)
+        for (char *p = buf; p < buf + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *e = (struct inotify_event*)p;
+            if (e->mask & IN_Q_OVERFLOW || (e->len && !strcmp(e->name, state.watch.name)))
+                changed = 1;
+        }
+    return changed;
+}
+#endif
+
+#if !defined(PLATFORM_WINDOWS)
+// Nanoseconds, a library rebuilt within the same second still counts
+static long long ModifiedTime(struct stat *attr) {
+#if defined(PLATFORM_MAC)
+    return attr->st_mtimespec.tv_sec * 1000000000LL + attr->st_mtimespec.tv_nsec;
+#else
+    return attr->st_mtim.tv_sec * 1000000000LL + attr->st_mtim.tv_nsec;
+#endif
+}
+#endif
+
+// Whether the file is a different one (or was written to) since last time
+static int LibraryFileChanged(void) {
 #if defined(PLATFORM_WINDOWS)
     FILETIME newTime = Win32GetLastWriteTime(state.args.path);
     int result = CompareFileTime(&newTime, &state.writeTime);
@@ -127,13 +614,33 @@ static int ShouldReloadLibrary(void) {
     return result;
 #else
     struct stat attr;
-    int result = !stat(state.args.path, &attr) && state.handleID != attr.st_ino;
-    if (result)
-        state.handleID = attr.st_ino;
+    if (stat(state.args.path, &attr))
+        return 0;
+    long long time = ModifiedTime(&attr);
+    int result = state.handleID != attr.st_ino || state.handleTime != time;
+    state.handleID = attr.st_ino;
+    state.handleTime = time;
     return result;
 #endif
 }
 
+static int ShouldReloadLibrary(void) {
+#if defined(PLATFORM_LINUX)
+    // Until something has loaded (or after a failed load) keep checking the
+    // file itself so it is picked up as soon as it's usable
+    if (state.watch.fd >= 0 && state.handle) {
+        // Read events either way so old ones don't trigger a reload later
+        int changed = WatchedLibraryChanged();
+        if (!state.watch.retry)
+            return changed;
+        // The file is checked even when an event came in, so the next frame
+        // doesn't see the same change again
+        return LibraryFileChanged() | changed;
+    }
+#endif
+    return LibraryFileChanged();
+}
+
 #if defined(PLATFORM_WINDOWS)
 char* RemoveExt(char* path) {
     char *ret = malloc(strlen(path) + 1);
@@ -147,148 +654,654 @@ char* RemoveExt(char* path) {
 }
 #endif
 
-static int ReloadLibrary(const char *path) {
-    if (!ShouldReloadLibrary())
-        return 1;
+#if !defined(PLATFORM_WINDOWS)
+static int CopyLibrary(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    if (!in)
+        return 0;
+    FILE *out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+    char buf[65536];
+    size_t n;
+    int result = 1;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (fwrite(buf, 1, n, out) != n) {
+            result = 0;
+            break;
+        }
+    fclose(in);
+    return !fclose(out) && result;
+}
+#endif
+
+static int OpenLibrary(void **handle, fwpScene **scene) {
+    static unsigned int generation = 0;
+    // The library is loaded from a copy: Windows locks loaded DLLs so they
+    // couldn't be rebuilt, and dlopen would hand back the old library while
+    // it's still open
+#if defined(PLATFORM_WINDOWS)
+    char *noExt = RemoveExt(state.args.path);
+    char *copy = malloc(strlen(noExt) + 32);
+    sprintf(copy, "%s.%u.tmp.dll", noExt, generation++);
+    free(noExt);
+    *handle = CopyFile(state.args.path, copy, 0) ? dlopen(copy, RTLD_NOW) : NULL;
+    free(copy);
+#else
+    char copy[1024];
+    const char *tmp = getenv("TMPDIR");
+    snprintf(copy, sizeof(copy), "%s/fwp-%d-%u.so", tmp ? tmp : "/tmp", (int)getpid(), generation++);
+    *handle = CopyLibrary(state.args.path, copy) ? dlopen(copy, RTLD_NOW) : NULL;
+    // Once it's mapped the file isn't needed anymore
+    unlink(copy);
+#endif
+    if (!*handle)
+        return 0;
+    if (!(*scene = dlsym(*handle, "scene"))) {
+        dlclose(*handle);
+        return 0;
+    }
+    return 1;
+}
 
+static fwpState* MigrateState(fwpScene *from, fwpScene *to) {
+    if (to->migrate)
+        return to->migrate(state.state, from->stateVersion);
+    fwpState *result = NULL;
+    if (to->stateSize && to->stateFields && from->stateFields &&
+        (result = calloc(1, to->stateSize))) {
+        fwpCopyFields(result, to->stateFields, state.state, from->stateFields);
+        free(state.state);
+        return result;
+    }
+    from->deinit(state.state);
+    return NULL;
+}
+
+static int SwapLibrary(void *handle, fwpScene *scene) {
     if (state.handle) {
+#if defined(FWP_JOBS)
+        DrainPool();
+#endif
         if (state.scene->unload)
             state.scene->unload(state.state);
+        // Needs the old library still loaded for its deinit and fields
+        if (state.state && state.scene->stateVersion != scene->stateVersion)
+            state.state = MigrateState(state.scene, scene);
         dlclose(state.handle);
     }
+    state.handle = handle;
+    state.scene = scene;
+    if (state.scene->windowWidth > 0 && state.scene->windowHeight > 0)
+        pbSetWindowSize(state.scene->windowWidth, state.scene->windowHeight);
+    if (state.scene->windowTitle)
+        pbSetWindowTitle(state.scene->windowTitle);
+    if (!state.state)
+        return !!(state.state = state.scene->init(state.buffer));
+    if (state.scene->reload)
+        state.scene->reload(state.state);
+    return 1;
+}
 
+static void ReloadFailed(void) {
+    printf("WARNING: Failed to reload \"%s\", keeping the old version\n", state.args.path);
+    // Try again once the file is written to or replaced, it may have been
+    // caught half written. Until then it's left alone rather than loaded
+    // (and warned about) every frame
 #if defined(PLATFORM_WINDOWS)
-    size_t newPathSize = strlen(path) + 4;
-    char *newPath = malloc(sizeof(char) * newPathSize);
-    char *noExt = RemoveExt(path);
-    sprintf(newPath, "%s.tmp.dll", noExt);
-    CopyFile(path, newPath, 0);
-    handle = dlopen(newPath, RTLD_NOW);
-    free(newPath);
-    free(noExt);
-    if (!state.handle)
+    state.writeTime = Win32GetLastWriteTime(state.args.path);
 #else
-    if (!(state.handle = dlopen(path, RTLD_NOW)))
-#endif
-        goto BAIL;
-    if (!(state.scene = dlsym(state.handle, "scene")))
-        goto BAIL;
-    if (!state.state) {
-        if (state.scene->windowWidth > 0 && state.scene->windowHeight > 0)
-            pbSetWindowSize(state.scene->windowWidth, state.scene->windowHeight);
-        if (state.scene->windowTitle)
-            pbSetWindowTitle(state.scene->windowTitle);
-        if (!(state.state = state.scene->init(state.buffer)))
-            goto BAIL;
-    } else {
-        if (state.scene->windowWidth > 0 && state.scene->windowHeight > 0)
-            pbSetWindowSize(state.scene->windowWidth, state.scene->windowHeight);
-        if (state.scene->windowTitle)
-            pbSetWindowTitle(state.scene->windowTitle);
-        if (state.scene->reload)
-            state.scene->reload(state.state);
+    struct stat attr;
+    if (!stat(state.args.path, &attr)) {
+        state.handleID = attr.st_ino;
+        state.handleTime = ModifiedTime(&attr);
     }
-    return 1;
+#endif
+#if defined(PLATFORM_LINUX)
+    state.watch.retry = 1;
+#endif
+}
 
-BAIL:
-    if (state.handle)
-        dlclose(state.handle);
-    state.handle = NULL;
-#if defined(PLATFORM_WINDOWS)
-    memset(&state.writeTime, 0, sizeof(FILETIME));
+#if defined(FWP_LOADER)
+static void* LoaderThread(void *arg) {
+    TraceThread("loader");
+    pthread_mutex_lock(&state.loader.lock);
+    for (;;) {
+        while (!state.loader.busy && state.loader.running)
+            pthread_cond_wait(&state.loader.wake, &state.loader.lock);
+        if (!state.loader.running)
+            break;
+        pthread_mutex_unlock(&state.loader.lock);
+        void *handle = NULL;
+        fwpScene *scene = NULL;
+        double start = pbTime();
+        int result = OpenLibrary(&handle, &scene) ? 1 : -1;
+        TraceEvent("load library", start, pbTime());
+        pthread_mutex_lock(&state.loader.lock);
+        state.loader.handle = handle;
+        state.loader.scene = scene;
+        state.loader.result = result;
+        state.loader.busy = 0;
+    }
+    pthread_mutex_unlock(&state.loader.lock);
+    return NULL;
+}
+
+static int BeginLoader(void) {
+    state.loader.running = 1;
+    pthread_mutex_init(&state.loader.lock, NULL);
+    pthread_cond_init(&state.loader.wake, NULL);
+    return !pthread_create(&state.loader.thread, NULL, LoaderThread, NULL);
+}
+
+static void EndLoader(void) {
+    pthread_mutex_lock(&state.loader.lock);
+    state.loader.running = 0;
+    pthread_cond_signal(&state.loader.wake);
+    pthread_mutex_unlock(&state.loader.lock);
+    pthread_join(state.loader.thread, NULL);
+    pthread_cond_destroy(&state.loader.wake);
+    pthread_mutex_destroy(&state.loader.lock);
+    if (state.loader.result > 0)
+        dlclose(state.loader.handle);
+}
+#endif
+
+// Called once per frame, only ever swaps libraries between frames
+static int ReloadLibrary(void) {
+    int changed = ShouldReloadLibrary();
+#if defined(FWP_LOADER)
+    pthread_mutex_lock(&state.loader.lock);
+    int result = state.loader.result;
+    state.loader.result = 0;
+    // Changes made while a load is in flight are picked up once it's done
+    state.loader.stale |= changed;
+    if (!state.loader.busy && state.loader.stale) {
+        state.loader.stale = 0;
+        state.loader.busy = 1;
+        pthread_cond_signal(&state.loader.wake);
+    }
+    void *handle = state.loader.handle;
+    fwpScene *scene = state.loader.scene;
+    pthread_mutex_unlock(&state.loader.lock);
 #else
-    state.handleID = 0;
+    void *handle = NULL;
+    fwpScene *scene = NULL;
+    int result = changed ? (OpenLibrary(&handle, &scene) ? 1 : -1) : 0;
 #endif
-    return 0;
+    if (result > 0) {
+#if defined(PLATFORM_LINUX)
+        state.watch.retry = 0;
+#endif
+        return SwapLibrary(handle, scene);
+    }
+    if (result < 0)
+        ReloadFailed();
+    return 1;
 }
 
-#define pbInputCallback(E)                    \
-    if (state.scene->event)                   \
-        state.scene->event(state.state, &(E)) \
-
-static void pbInputKeyboard(void *userdata, int key, int modifier, int isDown) {
-    pbEvent e = {
-        .type = KeyboardEvent,
-        .keyboard = {
-            .key = key,
-            .isdown = isDown
-        },
-        .modifier = modifier
-    };
-    pbInputCallback(e);
-}
-
-static void pbInputMouseButton(void *userdata, int button, int modifier, int isDown) {
-    pbEvent e = {
-        .type = MouseButtonEvent,
-        .mouse = {
-            .button = button,
-            .isdown = isDown
-        },
-        .modifier = modifier
-    };
-    pbInputCallback(e);
-}
-
-static void pbInputMouseMove(void *userdata, int x, int y, float dx, float dy) {
-    pbEvent e = {
-        .type = MouseMoveEvent,
-        .mouse = {
-            .position = {
-                .x = x,
-                .y = y,
-                .dx = dx,
-                .dy = dy
-            }
-        }
-    };
-    pbInputCallback(e);
+#define FWP_PROFILE_FRAMES 128
+#define FWP_PROFILE_ZONES 16
+
+enum {
+    PhasePoll,
+    PhaseReload,
+    PhaseEvents,
+    PhaseTick,
+    PhasePresent,
+    PhaseWait,
+    PhaseCount
+};
+
+static const char *phaseNames[PhaseCount] = {
+    "poll", "reload", "events", "tick", "present", "wait"
+};
+
+static struct {
+    // F3 only toggles the overlay when --profile was given
+    int enabled, visible, frame;
+    double mark, current[PhaseCount];
+    double phases[PhaseCount][FWP_PROFILE_FRAMES];
+    double frames[FWP_PROFILE_FRAMES];
+    // Scene zones can come from worker threads, the lock only guards these.
+    // Names are copied as they may belong to a library that gets unloaded
+    atomic_flag lock;
+    struct {
+        char name[24];
+        double current, history[FWP_PROFILE_FRAMES];
+    } zones[FWP_PROFILE_ZONES];
+    int zoneCount;
+    // Pixels the overlay was drawn over, one per framebuffer (see PublishFrame)
+    struct {
+        int *pixels;
+        int width, height, capacity;
+    } under[3];
+} profile = { .lock = ATOMIC_FLAG_INIT };
+
+static void ProfileZone(const char *name, double start, double end, void *userdata) {
+    TraceEvent(name, start, end);
+    while (atomic_flag_test_and_set_explicit(&profile.lock, memory_order_acquire))
+        ;
+    int i;
+    for (i = 0; i < profile.zoneCount; i++)
+        if (!strncmp(profile.zones[i].name, name, sizeof(profile.zones[i].name) - 1))
+            break;
+    if (i == profile.zoneCount && i < FWP_PROFILE_ZONES) {
+        strncpy(profile.zones[i].name, name, sizeof(profile.zones[i].name) - 1);
+        profile.zoneCount++;
+    }
+    if (i < FWP_PROFILE_ZONES)
+        profile.zones[i].current += end - start;
+    atomic_flag_clear_explicit(&profile.lock, memory_order_release);
 }
 
-static void pbInputMouseScroll(void *userdata, float dx, float dy, int modifier) {
-    pbEvent e = {
-        .type = MouseScrollEvent,
-        .mouse = {
-            .wheel = {
-                .dx = dx,
-                .dy = dy
-            }
-        }
-    };
-    pbInputCallback(e);
+// Adds the time since the last mark to `phase`
+static void ProfileMark(int phase) {
+    double now = pbTime();
+    TraceEvent(phaseNames[phase], profile.mark, now);
+    profile.current[phase] += now - profile.mark;
+    profile.mark = now;
 }
 
-static void pbInputFocus(void *userdata, int isFocused) {
-    pbEvent e = {
-        .type = FocusEvent,
-        .window = {
-            .focused = isFocused
+static void ProfileEndFrame(void) {
+    int slot = profile.frame++ % FWP_PROFILE_FRAMES;
+    double total = 0.;
+    for (int i = 0; i < PhaseCount; i++) {
+        total += profile.current[i];
+        profile.phases[i][slot] = profile.current[i];
+        profile.current[i] = 0.;
+    }
+    profile.frames[slot] = total;
+    while (atomic_flag_test_and_set_explicit(&profile.lock, memory_order_acquire))
+        ;
+    for (int i = 0; i < profile.zoneCount; i++) {
+        profile.zones[i].history[slot] = profile.zones[i].current;
+        profile.zones[i].current = 0.;
+    }
+    atomic_flag_clear_explicit(&profile.lock, memory_order_release);
+}
+
+static double Mean(const double *values, int count) {
+    double sum = 0.;
+    for (int i = 0; i < count; i++)
+        sum += values[i];
+    return count ? sum / count : 0.;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void DrawProfile(pbImage *img) {
+    int count = profile.frame < FWP_PROFILE_FRAMES ? profile.frame : FWP_PROFILE_FRAMES;
+    if (!count)
+        return;
+    double sorted[FWP_PROFILE_FRAMES];
+    memcpy(sorted, profile.frames, count * sizeof(double));
+    qsort(sorted, count, sizeof(double), CompareDoubles);
+    double p99 = sorted[(count * 99) / 100 < count ? (count * 99) / 100 : count - 1];
+
+    int x = 4, y = 4, lines = 1 + PhaseCount + profile.zoneCount;
+    pbImageDrawRectangle(img, 0, 0, 208, lines * 10 + 56, RGBA(0, 0, 0, 192), 1);
+    pbImageDrawStringFormat(img, x, y, RGB(255, 255, 255), "frame %6.2fms p99 %6.2f", Mean(profile.frames, count) * 1000., p99 * 1000.);
+    for (int i = 0; i < PhaseCount; i++)
+        pbImageDrawStringFormat(img, x, y += 10, RGB(200, 200, 200), "%-8s%6.2fms", phaseNames[i], Mean(profile.phases[i], count) * 1000.);
+    for (int i = 0; i < profile.zoneCount; i++)
+        pbImageDrawStringFormat(img, x, y += 10, RGB(255, 220, 120), " %-15.15s%6.2fms", profile.zones[i].name, Mean(profile.zones[i].history, count) * 1000.);
+
+    // Frame times oldest to newest, the line is the --fps target (or 60Hz)
+    int top = y + 14, height = 40;
+    double budget = state.args.fps > 0 ? 1. / state.args.fps : 1. / 60.;
+    for (int i = 0; i < count; i++) {
+        double t = profile.frames[(profile.frame - count + i) % FWP_PROFILE_FRAMES];
+        int h = (int)(t / (budget * 2.) * height);
+        h = h > height ? height : h < 1 ? 1 : h;
+        pbImageDrawLine(img, x + i, top + height, x + i, top + height - h, t > budget * 1.05 ? RGB(255, 64, 64) : RGB(64, 255, 64));
+    }
+    pbImageDrawLine(img, x, top + height / 2, x + FWP_PROFILE_FRAMES, top + height / 2, RGBA(255, 255, 255, 128));
+}
+
+// The overlay only goes over a frame on its way to the screen, what was under
+// it is put back afterwards so scenes and recordings never see it
+static void CoverProfile(pbImage *img, int slot) {
+    int lines = 1 + PhaseCount + profile.zoneCount;
+    int w = img->width < 208 ? img->width : 208;
+    int h = img->height < lines * 10 + 56 ? img->height : lines * 10 + 56;
+    if (w * h > profile.under[slot].capacity) {
+        int *pixels = realloc(profile.under[slot].pixels, w * h * sizeof(int));
+        if (!pixels)
+            return;
+        profile.under[slot].pixels = pixels;
+        profile.under[slot].capacity = w * h;
+    }
+    for (int y = 0; y < h; y++)
+        memcpy(profile.under[slot].pixels + y * w, img->buffer + y * img->stride, w * sizeof(int));
+    profile.under[slot].width = w;
+    profile.under[slot].height = h;
+    // Drawn through a view so nothing can spill outside what was saved
+    pbImage *view = pbImageView(img, 0, 0, w, h);
+    if (view) {
+        DrawProfile(view);
+        pbImageFree(view);
+    }
+}
+
+static void PasteUnderProfile(pbImage *img, int slot) {
+    int w = profile.under[slot].width, h = profile.under[slot].height;
+    if (!w || !h)
+        return;
+    for (int y = 0; y < h; y++)
+        memcpy(img->buffer + y * img->stride, profile.under[slot].pixels + y * w, w * sizeof(int));
+    pbImageTouchRect(img, 0, 0, w, h);
+}
+
+static void UncoverProfile(pbImage *img, int slot) {
+    PasteUnderProfile(img, slot);
+    profile.under[slot].width = profile.under[slot].height = 0;
+}
+
+static void FreeProfile(void) {
+    for (int i = 0; i < 3; i++)
+        free(profile.under[i].pixels);
+}
+
+#if defined(FWP_PIPELINED)
+#define FWP_FRESH_FRAME 4
+
+static void* PresentThread(void *arg) {
+    TraceThread("present");
+    int current = 2;
+    unsigned int presented = 0;
+    for (;;) {
+        sem_wait(&state.pipeline.ready);
+        int next = atomic_exchange(&state.pipeline.mailbox, current);
+        current = next & 3;
+        // Several frames can be published before this thread wakes up, only
+        // the newest one is kept so later wakeups can find nothing new
+        if (next & FWP_FRESH_FRAME) {
+            double start = pbTime();
+            if (state.pipeline.frames[current] != presented + 1)
+                pbImageTouch(state.pipeline.buffers[current]);
+            presented = state.pipeline.frames[current];
+            pbFlush(state.pipeline.buffers[current]);
+            TraceEvent("flush", start, pbTime());
         }
-    };
-    pbInputCallback(e);
+        if (!atomic_load(&state.pipeline.running))
+            break;
+    }
+    return NULL;
 }
 
-static void pbInputResized(void *userdata, int w, int h) {
-    pbEvent e = {
-        .type = ResizedEvent,
-        .window = {
-            .size = {
-                .width = w,
-                .height = h
-            }
+static int BeginPipeline(void) {
+    state.pipeline.buffers[0] = state.buffer;
+    for (int i = 1; i < 3; i++)
+        if (!(state.pipeline.buffers[i] = pbFramebufferNew(state.args.width, state.args.height)))
+            return 0;
+    state.pipeline.render = 0;
+    state.pipeline.frame = 0;
+    atomic_store(&state.pipeline.mailbox, 1);
+    atomic_store(&state.pipeline.running, 1);
+    sem_init(&state.pipeline.ready, 0, 0);
+    return !pthread_create(&state.pipeline.thread, NULL, PresentThread, NULL);
+}
+
+static void PublishFrame(void) {
+    pbImage *done = state.buffer;
+    int slot = state.pipeline.render;
+    if (profile.visible)
+        CoverProfile(done, slot);
+    state.pipeline.frames[slot] = ++state.pipeline.frame;
+    state.pipeline.render = atomic_exchange(&state.pipeline.mailbox, state.pipeline.render | FWP_FRESH_FRAME) & 3;
+    state.buffer = state.pipeline.buffers[state.pipeline.render];
+    UncoverProfile(state.buffer, state.pipeline.render);
+    if (state.scene->keepFrame) {
+        // The screen will have the frame that was copied, only what's drawn
+        // from here on needs presenting
+        memcpy(state.buffer->buffer, done->buffer, (size_t)done->stride * done->height * sizeof(int));
+        pbImageClearDirty(state.buffer);
+    }
+    // Along with whatever the overlay is covering on screen
+    PasteUnderProfile(state.buffer, slot);
+    sem_post(&state.pipeline.ready);
+}
+
+static void EndPipeline(void) {
+    atomic_store(&state.pipeline.running, 0);
+    sem_post(&state.pipeline.ready);
+    pthread_join(state.pipeline.thread, NULL);
+    sem_destroy(&state.pipeline.ready);
+    for (int i = 0; i < 3; i++)
+        if (state.pipeline.buffers[i] != state.buffer)
+            pbImageFree(state.pipeline.buffers[i]);
+}
+#endif
+
+#if defined(FWP_RECORD)
+#define FWP_RECORD_SLOTS (sizeof(state.record.slots) / sizeof(state.record.slots[0]))
+
+static void* RecordThread(void *arg) {
+    TraceThread("recorder");
+    char path[1024];
+    pthread_mutex_lock(&state.record.lock);
+    for (;;) {
+        while (state.record.head == state.record.tail && state.record.running)
+            pthread_cond_wait(&state.record.wake, &state.record.lock);
+        // Keep going until everything queued before stopping is written
+        if (state.record.head == state.record.tail)
+            break;
+        unsigned int slot = state.record.head % FWP_RECORD_SLOTS;
+        pthread_mutex_unlock(&state.record.lock);
+        snprintf(path, sizeof(path), "%s/%06d.qoi", state.args.record, state.record.frames[slot]);
+        double start = pbTime();
+        int failed = pbImageSave(state.record.slots[slot], path) != 0;
+        TraceEvent("save frame", start, pbTime());
+        pthread_mutex_lock(&state.record.lock);
+        state.record.failed += failed;
+        state.record.head++;
+    }
+    pthread_mutex_unlock(&state.record.lock);
+    return NULL;
+}
+
+static int BeginRecording(void) {
+    if (mkdir(state.args.record, 0755) && errno != EEXIST) {
+        printf("ERROR: Failed to create directory \"%s\"\n", state.args.record);
+        return 0;
+    }
+    for (int i = 0; i < FWP_RECORD_SLOTS; i++)
+        if (!(state.record.slots[i] = pbImageNew(state.buffer->width, state.buffer->height)))
+            return 0;
+    state.record.running = 1;
+    pthread_mutex_init(&state.record.lock, NULL);
+    pthread_cond_init(&state.record.wake, NULL);
+    return !pthread_create(&state.record.thread, NULL, RecordThread, NULL);
+}
+
+static void RecordFrame(void) {
+    pthread_mutex_lock(&state.record.lock);
+    int full = state.record.tail - state.record.head == FWP_RECORD_SLOTS;
+    pthread_mutex_unlock(&state.record.lock);
+    // Dropped frames still use up a number so gaps show in the sequence
+    int frame = state.record.frame++;
+    if (full) {
+        state.record.dropped++;
+        return;
+    }
+    // The writer only reads slots before tail, this one is ours until it moves
+    unsigned int slot = state.record.tail % FWP_RECORD_SLOTS;
+    pbImage *dst = state.record.slots[slot];
+    memcpy(dst->buffer, state.buffer->buffer, (size_t)dst->stride * dst->height * sizeof(int));
+    state.record.frames[slot] = frame;
+    pthread_mutex_lock(&state.record.lock);
+    state.record.tail++;
+    pthread_cond_signal(&state.record.wake);
+    pthread_mutex_unlock(&state.record.lock);
+}
+
+static void EndRecording(void) {
+    pthread_mutex_lock(&state.record.lock);
+    state.record.running = 0;
+    pthread_cond_signal(&state.record.wake);
+    pthread_mutex_unlock(&state.record.lock);
+    pthread_join(state.record.thread, NULL);
+    pthread_cond_destroy(&state.record.wake);
+    pthread_mutex_destroy(&state.record.lock);
+    for (int i = 0; i < FWP_RECORD_SLOTS; i++)
+        pbImageFree(state.record.slots[i]);
+    printf("Recorded %d frames to \"%s\", %d dropped", state.record.frame - state.record.dropped - state.record.failed, state.args.record, state.record.dropped);
+    if (state.record.failed)
+        printf(", %d failed to write", state.record.failed);
+    puts("");
+}
+#endif
+
+static int Tick(double delta) {
+    if (state.args.fixed <= 0)
+        return state.scene->tick(state.state, state.buffer, delta);
+    double step = 1. / state.args.fixed;
+    // Don't try to catch up on long stalls (breakpoints, reloads), the steps
+    // would take long enough that the next frame has to catch up as well
+    state.accumulator += delta > .25 ? .25 : delta;
+    for (; state.accumulator >= step; state.accumulator -= step)
+        if (!state.scene->tick(state.state, state.buffer, step))
+            return 0;
+    return 1;
+}
+
+static void DeliverEvents(void) {
+    static pbEvent events[PB_EVENT_QUEUE_SIZE];
+    int count = pbDrainEvents(events, PB_EVENT_QUEUE_SIZE);
+    // With --profile, F3 belongs to the overlay and scenes don't see it
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (profile.enabled && events[i].type == KeyboardEvent && events[i].keyboard.key == KEY_F3) {
+            if (events[i].keyboard.isdown)
+                profile.visible = !profile.visible;
+            continue;
         }
-    };
-    pbInputCallback(e);
+        events[kept++] = events[i];
+    }
+    count = kept;
+    if (!count)
+        return;
+    if (state.scene->events)
+        state.scene->events(state.state, events, count);
+    else if (state.scene->event)
+        for (int i = 0; i < count; i++)
+            state.scene->event(state.state, &events[i]);
 }
 
-static void pbInputClosed(void *userdata) {
-    pbEvent e = {
-        .type = ClosedEvent,
-        .window = {
-            .closed = true
+static void Run(void) {
+    double last = pbTime(), deadline = last;
+    profile.mark = last;
+    while (pbPoll()) {
+        ProfileMark(PhasePoll);
+        if (!ReloadLibrary())
+            break;
+        ProfileMark(PhaseReload);
+        DeliverEvents();
+        ProfileMark(PhaseEvents);
+        double now = pbTime();
+        if (!Tick(now - last))
+            break;
+        last = now;
+        ProfileMark(PhaseTick);
+#if defined(FWP_RECORD)
+        if (state.args.record)
+            RecordFrame();
+#endif
+#if defined(FWP_PIPELINED)
+        if (state.args.pipelined)
+            PublishFrame();
+        else
+#endif
+        {
+            if (profile.visible)
+                CoverProfile(state.buffer, 0);
+            pbFlush(state.buffer);
+            UncoverProfile(state.buffer, 0);
         }
-    };
-    pbInputCallback(e);
+        ProfileMark(PhasePresent);
+
+        if (state.args.fps > 0) {
+            deadline += 1. / state.args.fps;
+            // Running more than a frame behind, start counting from now
+            // instead of rushing through frames to catch up
+            if ((now = pbTime()) - deadline > 1. / state.args.fps)
+                deadline = now;
+            pbSleepUntil(deadline);
+        }
+        ProfileMark(PhaseWait);
+        ProfileEndFrame();
+    }
+}
+
+// pbTime can be stepped by the backend (headless), benchmarks need the real thing
+static double BenchClock(void) {
+#if defined(PLATFORM_WINDOWS)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+// Nearest rank, `sorted` has to be in ascending order
+static double Percentile(const double *sorted, int count, double p) {
+    int rank = (int)(p * count);
+    rank += rank < p * count;
+    return sorted[rank < 1 ? 0 : rank > count ? count - 1 : rank - 1];
+}
+
+// Times poll, events, tick and flush for each frame, reloading and frame
+// pacing are left out
+static void Bench(void) {
+    double *times = malloc(state.args.bench * sizeof(double));
+    if (!times)
+        return;
+    int count = 0;
+    double last = pbTime(), total = 0.;
+    for (int i = 0; i < state.args.warmup + state.args.bench; i++) {
+        double start = BenchClock();
+        if (!pbPoll())
+            break;
+        DeliverEvents();
+        double now = pbTime();
+        if (!Tick(now - last))
+            break;
+        last = now;
+        if (!state.args.noFlush)
+            pbFlush(state.buffer);
+        if (i >= state.args.warmup)
+            total += times[count++] = BenchClock() - start;
+    }
+    if (!count) {
+        puts("ERROR: Scene stopped before any frames were timed");
+        free(times);
+        return;
+    }
+
+    qsort(times, count, sizeof(double), CompareDoubles);
+    double pixels = (double)state.buffer->width * state.buffer->height * count / total;
+    printf("bench: %d frames at %ux%u, %d warmup, %s\n", count, state.buffer->width, state.buffer->height, state.args.warmup, state.args.noFlush ? "no flush" : "flushed");
+    printf("  min %.3fms  mean %.3fms  p50 %.3fms  p95 %.3fms  p99 %.3fms  max %.3fms\n",
+           times[0] * 1000., total / count * 1000., Percentile(times, count, .5) * 1000.,
+           Percentile(times, count, .95) * 1000., Percentile(times, count, .99) * 1000., times[count - 1] * 1000.);
+    printf("  %.2f Mpixels/s\n", pixels / 1e6);
+    printf("{\"frames\":%d,\"warmup\":%d,\"width\":%u,\"height\":%u,\"flush\":%s,"
+           "\"min_ms\":%.4f,\"mean_ms\":%.4f,\"p50_ms\":%.4f,\"p95_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f,"
+           "\"pixels_per_second\":%.0f}\n",
+           count, state.args.warmup, state.buffer->width, state.buffer->height, state.args.noFlush ? "false" : "true",
+           times[0] * 1000., total / count * 1000., Percentile(times, count, .5) * 1000.,
+           Percentile(times, count, .95) * 1000., Percentile(times, count, .99) * 1000., times[count - 1] * 1000., pixels);
+    free(times);
 }
 
 int main(int argc, char *argv[]) {
@@ -296,7 +1309,8 @@ int main(int argc, char *argv[]) {
     extern int optopt;
     extern int optind;
     int opt;
-    while ((opt = getopt_long(argc, argv, ":w:h:t:uar", long_options, NULL)) != -1) {
+    state.args.fps = 60.;
+    while ((opt = getopt_long(argc, argv, ":w:h:t:uarPf:F:ce:R:OT:B:W:Nj:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'w':
                 state.args.width = atoi(optarg);
@@ -313,6 +1327,63 @@ int main(int argc, char *argv[]) {
             case 'a':
                 state.args.flags |= pbAlwaysOnTop;
                 break;
+            case 'P':
+#if defined(FWP_PIPELINED)
+                state.args.pipelined = 1;
+                state.args.flags |= pbThreadedFlush;
+#else
+                puts("WARNING: --pipelined isn't supported on this platform, ignoring");
+#endif
+                break;
+            case 'f':
+                state.args.fps = atof(optarg);
+                break;
+            case 'F':
+                state.args.fixed = atof(optarg);
+                break;
+            case 'c':
+                state.args.flags |= pbCoalesceMotion;
+                break;
+            case 'e':
+                state.args.eventBudget = atof(optarg) / 1000.;
+                break;
+            case 'O':
+                profile.enabled = profile.visible = 1;
+                break;
+            case 'T':
+                state.args.trace = optarg;
+                break;
+            case 'B':
+                if ((state.args.bench = atoi(optarg)) < 1) {
+                    printf("ERROR: \"-B\" needs at least one frame, got \"%s\"\n", optarg);
+                    usage();
+                    return 0;
+                }
+                break;
+            case 'W':
+                if ((state.args.warmup = atoi(optarg)) < 0) {
+                    printf("ERROR: \"-W\" can't be negative, got \"%s\"\n", optarg);
+                    usage();
+                    return 0;
+                }
+                break;
+            case 'N':
+                state.args.noFlush = 1;
+                break;
+            case 'j':
+#if defined(FWP_JOBS)
+                state.args.threads = atoi(optarg);
+#else
+                puts("WARNING: --threads isn't supported on this platform, ignoring");
+#endif
+                break;
+            case 'R':
+#if defined(FWP_RECORD)
+                state.args.record = optarg;
+#else
+                puts("WARNING: --record isn't supported on this platform, ignoring");
+#endif
+                break;
             case ':':
                 printf("ERROR: \"-%c\" requires an value!\n", optopt);
                 usage();
@@ -339,8 +1410,8 @@ int main(int argc, char *argv[]) {
     }
     if (state.args.path) {
 #if !defined(PLATFORM_WINDOWS)
-        if (state.args.path[0] != '.' || state.args.path[1] != '/') {
-            char *tmp = malloc(strlen(state.args.path) + 2 * sizeof(char));
+        if (!strchr(state.args.path, '/')) {
+            char *tmp = malloc(strlen(state.args.path) + 3 * sizeof(char));
             sprintf(tmp, "./%s", state.args.path);
             state.args.path = tmp;
         } else
@@ -359,30 +1430,81 @@ int main(int argc, char *argv[]) {
         state.args.height = 480;
     if (!state.args.title)
         state.args.title = "fwp";
+#if defined(PLATFORM_LINUX)
+    BeginWatch();
+#endif
     pbBegin(state.args.width, state.args.height, state.args.title, state.args.flags);
+    pbSetPollBudget(state.args.eventBudget);
 
-    if (!(state.buffer = pbImageNew(state.args.width, state.args.height)))
+    if (!(state.buffer = pbFramebufferNew(state.args.width, state.args.height)))
         return 0;
 
-    if (!ReloadLibrary(state.args.path))
+#if defined(FWP_JOBS)
+    // Before the scene is loaded, init may already want to use it
+    if (!BeginPool())
         return 0;
+#endif
 
-#define X(NAME, _) pbInput##NAME,
-    pbCallbacks(FWP_PB_CALLBACKS NULL);
-#undef X
-
-    while (pbPoll()) {
-        if (!ReloadLibrary(state.args.path))
-            break;
-        if (!state.scene->tick(state.state, state.buffer, 0.f))
-            break;
-        pbFlush(state.buffer);
+    void *handle;
+    fwpScene *scene;
+    if (!ShouldReloadLibrary() || !OpenLibrary(&handle, &scene) || !SwapLibrary(handle, scene)) {
+        printf("ERROR: Failed to load \"%s\"\n", state.args.path);
+        return 0;
     }
+#if defined(FWP_LOADER)
+    if (!BeginLoader())
+        return 0;
+#endif
+
+#if defined(FWP_PIPELINED)
+    if (state.args.pipelined && !BeginPipeline())
+        return 0;
+#endif
+#if defined(FWP_RECORD)
+    if (state.args.record && !BeginRecording())
+        return 0;
+#endif
+
+    TraceThread("main");
+    pbSetProfiler(ProfileZone, NULL);
+    if (state.args.bench)
+        Bench();
+    else
+        Run();
+    // Whatever the last poll queued, ClosedEvent included, still reaches the
+    // scene before it is torn down
+    if (state.state)
+        DeliverEvents();
+    pbSetProfiler(NULL, NULL);
 
+#if defined(FWP_PIPELINED)
+    if (state.args.pipelined)
+        EndPipeline();
+#endif
+#if defined(FWP_RECORD)
+    if (state.args.record)
+        EndRecording();
+#endif
+#if defined(FWP_LOADER)
+    EndLoader();
+#endif
+#if defined(FWP_JOBS)
+    DrainPool();
+#endif
     state.scene->deinit(state.state);
+#if defined(FWP_JOBS)
+    EndPool();
+#endif
     if (state.handle)
         dlclose(state.handle);
     pbImageFree(state.buffer);
+    FreeProfile();
+    if (state.args.trace)
+        EndTrace();
+#if defined(PLATFORM_LINUX)
+    if (state.watch.fd >= 0)
+        close(state.watch.fd);
+#endif
 #if !defined(PLATFORM_WINDOWS)
     free(state.args.path);
 #endif
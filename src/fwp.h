@@ -25,40 +25,30 @@ extern "C" {
 
 #include "pb.h"
 #include "rng.h"
+#include <string.h>
 
 typedef struct fwpState fwpState;
 
-typedef enum {
-#define X(NAME, ARGS) NAME##Event,
-    FWP_PB_CALLBACKS
-#undef X
-} pbEventType;
-
+// Describes one member of a fwpState so it can be carried over when the
+// struct's layout changes, lists end with an empty entry
 typedef struct {
-    struct {
-        int button;
-        int isdown;
-        struct {
-            unsigned int x, y;
-            float dx, dy;
-        } position;
-        struct {
-            float dx, dy;
-        } wheel;
-    } mouse;
-    struct {
-        pbKey key;
-        int isdown;
-    } keyboard;
-    pbMod modifier;
-    struct {
-        int focused, closed;
-        struct {
-            unsigned int width, height;
-        } size;
-    } window;
-    pbEventType type;
-} pbEvent;
+    const char *name;
+    size_t offset, size;
+} fwpField;
+
+#define FWP_FIELD(TYPE, FIELD) { #FIELD, offsetof(TYPE, FIELD), sizeof(((TYPE*)0)->FIELD) }
+
+// Copy every field in `to` that `from` has with the same name and size,
+// anything else in `to` is left as it is
+static inline void fwpCopyFields(void *to, const fwpField *toFields, const void *from, const fwpField *fromFields) {
+    for (const fwpField *t = toFields; t->name; t++)
+        for (const fwpField *f = fromFields; f->name; f++)
+            if (!strcmp(t->name, f->name)) {
+                if (t->size == f->size)
+                    memcpy((char*)to + t->offset, (const char*)from + f->offset, t->size);
+                break;
+            }
+}
 
 typedef struct {
     int windowWidth;
@@ -70,8 +60,84 @@ typedef struct {
     void(*unload)(fwpState*);
     int(*event)(fwpState*, pbEvent*);
     int(*tick)(fwpState*, pbImage*, double);
+    // Takes precedence over `event`, gets everything since the last frame at once
+    int(*events)(fwpState*, pbEvent*, int);
+    // Bump stateVersion whenever fwpState's layout changes. On a reload where
+    // it differs, migrate gets the old state (and owns it) and returns the
+    // new one. Without migrate, if both versions list their stateFields, a
+    // zeroed stateSize block is allocated, the matching fields are copied
+    // over and the old state is free'd. Otherwise the old scene's deinit and
+    // the new scene's init are called
+    int stateVersion;
+    size_t stateSize;
+    const fwpField *stateFields;
+    fwpState*(*migrate)(fwpState*, int);
+    // Set when tick draws over the last frame instead of redrawing all of it.
+    // With --pipelined every frame goes to a different buffer, this has the
+    // last frame copied into the next one first
+    int keepFrame;
 } fwpScene;
 
+// fwp installs a work-stealing thread pool (sized by --threads) behind pb's
+// pbParallelFor and pbSpawn, these are shorthands for scenes. The pool
+// belongs to fwp, so it's there for as long as fwp runs, across reloads
+typedef pbTask fwpTask;
+typedef void(*fwpRange)(void *ctx, int begin, int end);
+
+typedef struct {
+    int begin, end, grain;
+    fwpRange fn;
+    void *ctx;
+} fwpParallelForJob;
+
+static inline void fwpParallelForChunk(void *userdata, int index) {
+    fwpParallelForJob *job = (fwpParallelForJob*)userdata;
+    int begin = job->begin + index * job->grain;
+    int end = begin + job->grain;
+    job->fn(job->ctx, begin, end > job->end ? job->end : end);
+}
+
+// Calls fn on chunks of [begin, end) no bigger than grain and returns once
+// all of them are done
+static inline void fwpParallelFor(int begin, int end, int grain, fwpRange fn, void *ctx) {
+    if (end <= begin)
+        return;
+    if (grain < 1)
+        grain = 1;
+    fwpParallelForJob job = { begin, end, grain, fn, ctx };
+    pbParallelFor((end - begin + grain - 1) / grain, fwpParallelForChunk, &job);
+}
+
+// Runs job(ctx, 0) ... job(ctx, count - 1) in the background
+static inline fwpTask* fwpSpawn(int count, pbJob job, void *ctx) {
+    return pbSpawn(count, job, ctx);
+}
+
+static inline void fwpWait(fwpTask *task) {
+    pbWait(task);
+}
+
+// Times from here to the end of the enclosing block and reports it to pb's
+// profiler (shown in fwp's overlay). Needs the cleanup attribute, so it does
+// nothing on compilers without it
+#if defined(__GNUC__) || defined(__clang__)
+typedef struct {
+    const char *name;
+    double start;
+} fwpProfileScope;
+
+static inline void fwpProfileScopeEnd(fwpProfileScope *scope) {
+    pbProfileZone(scope->name, scope->start, pbTime());
+}
+
+#define FWP_CONCAT_(A, B) A##B
+#define FWP_CONCAT(A, B) FWP_CONCAT_(A, B)
+#define FWP_PROFILE_SCOPE(NAME) \
+    fwpProfileScope FWP_CONCAT(fwp__scope, __LINE__) __attribute__((cleanup(fwpProfileScopeEnd))) = { NAME, pbTime() }
+#else
+#define FWP_PROFILE_SCOPE(NAME)
+#endif
+
 #if defined(__cplusplus)
 }
 #endif
@@ -180,33 +180,165 @@ typedef enum {
     Black = -16777216,
 } pbBuiltinColor;
 
-int RGBA(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
-int RGB(uint8_t r, uint8_t g, uint8_t b);
-int RGBA1(uint8_t c, uint8_t a);
-int RGB1(uint8_t c);
+static inline int RGBA(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+    return ((uint8_t)a << 24) | ((uint8_t)r << 16) | ((uint8_t)g << 8) | b;
+}
+
+static inline int RGB(uint8_t r, uint8_t g, uint8_t b) {
+    return RGBA(r, g, b, 255);
+}
+
+static inline int RGBA1(uint8_t c, uint8_t a) {
+    return RGBA(c, c, c, a);
+}
+
+static inline int RGB1(uint8_t c) {
+    return RGB(c, c, c);
+}
+
+static inline uint8_t Rgba(int c) {
+    return (uint8_t)((c >> 16) & 0xFF);
+}
+
+static inline uint8_t rGba(int c) {
+    return (uint8_t)((c >>  8) & 0xFF);
+}
+
+static inline uint8_t rgBa(int c) {
+    return (uint8_t)(c & 0xFF);
+}
+
+static inline uint8_t rgbA(int c) {
+    return (uint8_t)((c >> 24) & 0xFF);
+}
+
+static inline int rGBA(int c, uint8_t r) {
+    return (c & ~0x00FF0000) | (r << 16);
+}
+
+static inline int RgBA(int c, uint8_t g) {
+    return (c & ~0x0000FF00) | (g << 8);
+}
+
+static inline int RGbA(int c, uint8_t b) {
+    return (c & ~0x000000FF) | b;
+}
 
-uint8_t Rgba(int c);
-uint8_t rGba(int c);
-uint8_t rgBa(int c);
-uint8_t rgbA(int c);
+static inline int RGBa(int c, uint8_t a) {
+    return (c & ~0xFF000000) | (a << 24);
+}
+
+typedef enum {
+    pbFormatStraight = 0,
+    pbFormatPremultiplied
+} pbFormat;
 
-int rGBA(int c, uint8_t r);
-int RgBA(int c, uint8_t g);
-int RGbA(int c, uint8_t b);
-int RGBa(int c, uint8_t a);
+typedef struct {
+    size_t allocations, releases;
+    size_t bytesInUse, peakBytes;
+    size_t poolHits, poolMisses;
+} pbAllocatorStats;
+
+// Memory handed out must be aligned to PB_ALIGNMENT (64) bytes. pb doesn't
+// hold any lock while calling alloc or release, allocators shared between
+// threads have to do their own locking
+typedef struct pbAllocator {
+    void*(*alloc)(struct pbAllocator *allocator, size_t size);
+    void(*release)(struct pbAllocator *allocator, void *ptr, size_t size);
+    void *userdata;
+    pbAllocatorStats stats;
+} pbAllocator;
+
+#define PB_ALIGNMENT 64
+
+// Default allocator, keeps freed image buffers around in size-class pools
+pbAllocator* pbPoolAllocator(void);
+void pbPoolTrim(void);
+// Bump allocator for per-frame temporaries, images made from an arena don't
+// need pbImageFree, pbArenaReset releases (and invalidates) all of them at once.
+// Once it's full pbImageNew returns NULL until the next reset
+pbAllocator* pbArenaNew(size_t capacity);
+void pbArenaReset(pbAllocator *arena);
+void pbArenaFree(pbAllocator *arena);
+// Allocator used by pbImageNew and friends, NULL restores the pool
+void pbSetAllocator(pbAllocator *allocator);
+
+// Called once for every index in [0, count), possibly from several threads
+typedef void(*pbJob)(void *userdata, int index);
+// Must run every job before returning
+typedef void(*pbDispatcher)(pbJob job, void *userdata, int count);
+
+// Runs jobs on pb's worker threads (or whatever pbSetDispatcher installed)
+void pbParallelFor(int count, pbJob job, void *userdata);
+// NULL restores the built-in worker pool
+void pbSetDispatcher(pbDispatcher dispatcher);
+
+// Handle to jobs started with pbSpawn, every one has to be passed to pbWait
+typedef struct pbTask pbTask;
+typedef pbTask*(*pbSpawner)(int count, pbJob job, void *userdata);
+typedef void(*pbWaiter)(pbTask *task);
+
+// Starts the jobs and returns straight away when a task system has been
+// installed (fwp installs its thread pool), without one they run through
+// pbParallelFor before it returns
+pbTask* pbSpawn(int count, pbJob job, void *userdata);
+// Returns once every job of the task has finished
+void pbWait(pbTask *task);
+// NULLs go back to running tasks on pbSpawn
+void pbSetTaskSystem(pbSpawner spawn, pbWaiter wait);
 
 typedef struct {
+    int x, y, w, h;
+} pbRect;
+
+#ifndef PB_MAX_DIRTY
+#define PB_MAX_DIRTY 16
+#endif
+
+typedef struct pbImage {
     unsigned int width, height;
+    // Distance between rows in pixels, can be larger than width
+    unsigned int stride;
     int *buffer;
+    pbFormat format;
+    pbAllocator *allocator;
+    // Views alias their parent's pixels instead of owning a buffer
+    struct pbImage *parent;
+    int parentX, parentY;
+    // Areas written since the last flush, see pbImageTrackDirty
+    int trackDirty, dirtyCount;
+    pbRect dirty[PB_MAX_DIRTY];
+    // Set on the tiles pbImageParallelTiles hands out, their touches are
+    // gathered in dirty[0] and passed to the parent once the tile is done
+    int batched;
 } pbImage;
 
 pbImage* pbImageNew(unsigned int w, unsigned int h);
 void pbImageFree(pbImage *img);
+void pbImageConvert(pbImage *img, pbFormat format);
+// Call after writing to img->buffer directly, pb's own functions do this
+void pbImageTouch(pbImage *img);
+void pbImageTouchRect(pbImage *img, int x, int y, int w, int h);
+// Remember which parts of the image change so pbFlush only has to upload
+// those, touching a view marks the matching area of its parent
+void pbImageTrackDirty(pbImage *img, int enable);
+// Merges overlapping areas first, rects stay valid until the next write
+int pbImageDirtyRects(pbImage *img, pbRect **rects);
+void pbImageClearDirty(pbImage *img);
 
 void pbImageFill(pbImage *img, int col);
+void pbImageFillSpan(pbImage *img, int x, int y, int w, int col);
+// src holds straight alpha colours like every other drawing function takes
+void pbImageBlendSpan(pbImage *img, int x, int y, const int *src, int n);
 void pbImageFlood(pbImage *img, int x, int y, int col);
+// Colours are blended over what's there, except alpha 0 which always writes a
+// transparent pixel, whether it's drawn, pasted or blended as a span
 void pbImagePSet(pbImage *img, int x, int y, int col);
 int pbImagePGet(pbImage *img, int x, int y);
+// xy holds n interleaved x, y pairs, points outside the image are skipped
+void pbImagePSetBatch(pbImage *img, const int *xy, const int *cols, int n);
+// Same as pbImagePSetBatch but every colour is written as is, no blending
+void pbImagePSetBatchOpaque(pbImage *img, const int *xy, const int *cols, int n);
 void pbImagePaste(pbImage *dst, pbImage *src, int x, int y);
 void pbImageClippedPaste(pbImage *dst, pbImage *src, int x, int y, int rx, int ry, int rw, int rh);
 pbImage* pbImageDupe(pbImage *src);
@@ -214,6 +346,13 @@ void pbImagePassThru(pbImage *img, int(*fn)(int x, int y, int col));
 pbImage* pbImageResized(pbImage *src, int nw, int nh);
 pbImage* pbImageRotated(pbImage *src, float angle);
 pbImage* pbImageClipped(pbImage *src, int rx, int ry, int rw, int rh);
+pbImage* pbImageView(pbImage *src, int rx, int ry, int rw, int rh);
+// Called with a view of one tile and where that tile starts in the image
+typedef void(*pbTileFn)(pbImage *tile, int x, int y, void *userdata);
+// Splits img into tiles (PB_TILE_SIZE square when tileW or tileH is <= 0) and
+// runs fn on each through pbParallelFor, drawing through the view stays
+// inside its tile so tiles never write over each other
+void pbImageParallelTiles(pbImage *img, int tileW, int tileH, pbTileFn fn, void *userdata);
 void pbImageDrawLine(pbImage *img, int x0, int y0, int x1, int y1, int col);
 void pbImageDrawCircle(pbImage *img, int xc, int yc, int r, int col, int fill);
 void pbImageDrawRectangle(pbImage *img, int x, int y, int w, int h, int col, int fill);
@@ -225,6 +364,8 @@ void pbImageDrawStringFormat(pbImage *img, int x, int y, int col, const char *fm
 
 pbImage* pbImageLoadFromPath(const char *path);
 pbImage* pbImageLoadFromMemory(const void *data, size_t length);
+// Format is picked from the extension: qoi, png, bmp, tga or jpg/jpeg.
+// Returns 0 on success, -1 on failure
 int pbImageSave(pbImage *img, const char *path);
 
 typedef enum {
@@ -232,7 +373,12 @@ typedef enum {
     pbFullscreen        = 1 << 1,
     pbFullscreenDesktop = 1 << 2,
     pbBorderless        = 1 << 3,
-    pbAlwaysOnTop       = 1 << 4
+    pbAlwaysOnTop       = 1 << 4,
+    // pbFlush will be called from another thread than pbPoll
+    pbThreadedFlush     = 1 << 5,
+    // Merge runs of mouse motion into a single MouseMove per pbPoll, dx/dy
+    // add up to the total movement (X11 and headless for now)
+    pbCoalesceMotion    = 1 << 6
 } pbFlags;
 
 typedef enum {
@@ -266,15 +412,74 @@ typedef enum {
     X(Focus,        (void*, int))                    \
     X(Closed,       (void*))
 
+typedef enum {
+#define X(NAME, ARGS) NAME##Event,
+    FWP_PB_CALLBACKS
+#undef X
+} pbEventType;
+
+typedef struct {
+    struct {
+        int button;
+        int isdown;
+        struct {
+            unsigned int x, y;
+            float dx, dy;
+        } position;
+        struct {
+            float dx, dy;
+        } wheel;
+    } mouse;
+    struct {
+        pbKey key;
+        int isdown;
+    } keyboard;
+    pbMod modifier;
+    struct {
+        int focused, closed;
+        struct {
+            unsigned int width, height;
+        } size;
+    } window;
+    pbEventType type;
+    // pbTime when the event was queued
+    double time;
+} pbEvent;
+
+// Events are queued as well as passed to the callbacks, when the queue is full
+// the oldest event is dropped to make room
+#define PB_EVENT_QUEUE_SIZE 256
+
 int pbBegin(unsigned int w, unsigned int h, const char *title, pbFlags flags);
 int pbPoll(void);
 void pbFlush(pbImage *buffer);
 void pbEnd(void);
+// Image to draw into and pass to pbFlush. Where the backend can share memory
+// with the display (XShm on X11) the pixels live there and flushing doesn't
+// copy anything. Free it with pbImageFree before calling pbEnd
+pbImage* pbFramebufferNew(unsigned int w, unsigned int h);
 
 void pbSetWindowTitle(const char *title);
 void pbWindowSize(unsigned int *w, unsigned int *h);
 void pbSetWindowSize(unsigned int w, unsigned int h);
 void pbCursorPosition(int *x, int *y);
+// Seconds since pbBegin, backends without a real clock (headless) step it
+// by a fixed amount every frame so runs are repeatable
+double pbTime(void);
+// Stop handling events once a pbPoll has taken this many seconds, the rest
+// are left for the next call, at least one event is always handled. 0 (the
+// default) handles everything queued.
+// Only the X11 backend checks it for now
+void pbSetPollBudget(double seconds);
+// Block until pbTime reaches `time`. Sleeps for most of the wait and spins
+// for the rest, as OS sleeps can wake up late
+void pbSleepUntil(double time);
+
+// Timed zones (start and end are pbTime) are passed on to whatever profiler
+// is installed, e.g. fwp's overlay. Can be called from any thread
+typedef void(*pbProfiler)(const char *name, double start, double end, void *userdata);
+void pbSetProfiler(pbProfiler profiler, void *userdata);
+void pbProfileZone(const char *name, double start, double end);
 
 #define X(NAME, ARGS) \
     void(*NAME##Callback)ARGS,
@@ -287,6 +492,28 @@ FWP_PB_CALLBACKS
 
 void pbUserdata(void *userdata);
 int pbRunning(void);
+// Move up to `max` queued events into `events`, oldest first. Returns how
+// many were copied. Call it from the same thread as pbPoll
+int pbDrainEvents(pbEvent *events, int max);
+
+// Inlined alternative to pbImagePassThru, EXPR can use x, y and col and
+// gives the new pixel, e.g. PB_PASSTHRU(img, col ^ 0x00FFFFFF)
+#define PB_PASSTHRU(IMG, EXPR)                                          \
+    do {                                                                \
+        pbImage *pb__img = (IMG);                                       \
+        for (int y = 0; y < (int)pb__img->height; y++) {                \
+            int *pb__row = pb__img->buffer + (size_t)y * pb__img->stride; \
+            for (int x = 0; x < (int)pb__img->width; x++) {             \
+                int col = pb__row[x];                                   \
+                pb__row[x] = (EXPR);                                    \
+            }                                                           \
+        }                                                               \
+        pbImageTouch(pb__img);                                          \
+    } while (0)
+
+// Same as pbImagePassThru but bands of rows are handed to pbParallelFor, fn
+// is called from several threads at once so it mustn't touch shared state
+void pbImageParallelPassThru(pbImage *img, int(*fn)(int x, int y, int col));
 
 #if defined(__cplusplus)
 }
@@ -298,122 +525,1045 @@ int pbRunning(void);
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(_WIN32)
+// windows.h can't be included here, its RGB macro clashes with ours
+__declspec(dllimport) void __stdcall Sleep(unsigned long milliseconds);
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
 
-int RGBA(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
-    return ((uint8_t)a << 24) | ((uint8_t)r << 16) | ((uint8_t)g << 8) | b;
+#if !defined(PB_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define PB_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PB_TARGET(ISA)
+#else
+#define PB_TARGET(ISA) __attribute__((target(ISA)))
+#endif
+#endif
+
+// Spans larger than this (in bytes) are written with non-temporal stores
+// so clearing a big framebuffer doesn't evict everything else from cache
+#ifndef PB_STREAM_THRESHOLD
+#define PB_STREAM_THRESHOLD (1 << 20)
+#endif
+
+#if !defined(PB_NO_THREADS) && !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define PB_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef PB_MAX_WORKERS
+#define PB_MAX_WORKERS 64
+#endif
+
+// Rows handed to a worker at a time by the image functions
+#ifndef PB_BAND_ROWS
+#define PB_BAND_ROWS 16
+#endif
+
+// Default tile edge for pbImageParallelTiles, 64x64 ints fit in L1
+#ifndef PB_TILE_SIZE
+#define PB_TILE_SIZE 64
+#endif
+
+static void fill_span_scalar(int *dst, int col, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = col;
 }
 
-int RGB(uint8_t r, uint8_t g, uint8_t b) {
-    return RGBA(r, g, b, 255);
+// Source-over with straight alpha: d + (s - d) * a / 255 per channel, the
+// alpha channel is treated as s = 255. Two channels are done per multiply
+// and x / 255 is computed as (x + 128 + ((x + 128) >> 8)) >> 8, which is
+// exact for every x in [0, 255 * 255]. Alpha 0 writes a transparent pixel
+// instead, the same as pbImagePSet always has, on every blend path
+static inline int blend_pixel(int d, int s) {
+    unsigned int a = (unsigned int)s >> 24;
+    if (a == 255)
+        return s;
+    if (!a)
+        return 0;
+    unsigned int ia = 255 - a;
+    unsigned int rb = (s & 0xFF00FF) * a + (d & 0xFF00FF) * ia + 0x800080;
+    unsigned int ag = (((s >> 8) & 0xFF00FF) | 0xFF0000) * a + ((d >> 8) & 0xFF00FF) * ia + 0x800080;
+    rb = ((rb + ((rb >> 8) & 0xFF00FF)) >> 8) & 0xFF00FF;
+    ag = (ag + ((ag >> 8) & 0xFF00FF)) & 0xFF00FF00;
+    return (int)(ag | rb);
 }
 
-int RGBA1(uint8_t c, uint8_t a) {
-    return RGBA(c, c, c, a);
+static void blend_span_scalar(int *dst, const int *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = blend_pixel(dst[i], src[i]);
 }
 
-int RGB1(uint8_t c) {
-    return RGB(c, c, c);
+static void blend_fill_span_scalar(int *dst, int col, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = blend_pixel(dst[i], col);
 }
 
-uint8_t Rgba(int c) {
-    return (uint8_t)((c >> 16) & 0xFF);
+// Premultiplied source-over: s + d * (255 - a) / 255, one multiply-add per channel
+static inline int blend_pixel_pm(int d, int s) {
+    unsigned int a = (unsigned int)s >> 24;
+    if (a == 255)
+        return s;
+    if (!a)
+        return 0;
+    unsigned int ia = 255 - a;
+    unsigned int rb = (d & 0xFF00FF) * ia + 0x800080;
+    unsigned int ag = ((d >> 8) & 0xFF00FF) * ia + 0x800080;
+    rb = ((rb + ((rb >> 8) & 0xFF00FF)) >> 8) & 0xFF00FF;
+    ag = (ag + ((ag >> 8) & 0xFF00FF)) & 0xFF00FF00;
+    // Colour channels can be larger than alpha when s isn't really
+    // premultiplied, saturate each one the same way the SIMD kernels do
+    unsigned int under = ag | rb, result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        unsigned int c = (((unsigned int)s >> shift) & 0xFF) + ((under >> shift) & 0xFF);
+        result |= (c > 255 ? 255 : c) << shift;
+    }
+    return (int)result;
 }
 
-uint8_t rGba(int c) {
-    return (uint8_t)((c >>  8) & 0xFF);
+static void blend_span_pm_scalar(int *dst, const int *src, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = blend_pixel_pm(dst[i], src[i]);
 }
 
-uint8_t rgBa(int c) {
-    return (uint8_t)(c & 0xFF);
+static void blend_fill_span_pm(int *dst, int col, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = blend_pixel_pm(dst[i], col);
 }
 
-uint8_t rgbA(int c) {
-    return (uint8_t)((c >> 24) & 0xFF);
+static inline int premultiply_pixel(int c) {
+    unsigned int a = (unsigned int)c >> 24;
+    unsigned int rb = (c & 0xFF00FF) * a + 0x800080;
+    unsigned int g = (c & 0xFF00) * a + 0x8000;
+    rb = ((rb + ((rb >> 8) & 0xFF00FF)) >> 8) & 0xFF00FF;
+    g = ((g + ((g >> 8) & 0xFF00)) >> 8) & 0xFF00;
+    return (int)((a << 24) | rb | g);
 }
 
-int rGBA(int c, uint8_t r) {
-    return (c & ~0x00FF0000) | (r << 16);
+// Colours passed to the drawing functions are straight alpha, premultiplied
+// images get them converted first
+static inline int blend_into(pbFormat format, int d, int col) {
+    return format == pbFormatPremultiplied ? blend_pixel_pm(d, premultiply_pixel(col)) : blend_pixel(d, col);
 }
 
-int RgBA(int c, uint8_t g) {
-    return (c & ~0x0000FF00) | (g << 8);
+static inline int unpremultiply_pixel(int c) {
+    unsigned int a = (unsigned int)c >> 24;
+    if (!a || a == 255)
+        return c;
+    unsigned int r = (((c >> 16) & 0xFF) * 255 + a / 2) / a;
+    unsigned int g = (((c >> 8) & 0xFF) * 255 + a / 2) / a;
+    unsigned int b = ((c & 0xFF) * 255 + a / 2) / a;
+    // Clamp in case the colour channels are larger than alpha (not really premultiplied)
+    return (int)((a << 24) | ((r > 255 ? 255 : r) << 16) | ((g > 255 ? 255 : g) << 8) | (b > 255 ? 255 : b));
 }
 
-int RGbA(int c, uint8_t b) {
-    return (c & ~0x000000FF) | b;
+#if defined(PB_SIMD_X86)
+PB_TARGET("sse2") static void fill_span_sse2(int *dst, int col, size_t n) {
+    for (; n && ((uintptr_t)dst & 15); n--)
+        *dst++ = col;
+    __m128i v = _mm_set1_epi32(col);
+    if (n * sizeof(int) >= PB_STREAM_THRESHOLD) {
+        for (; n >= 16; n -= 16, dst += 16) {
+            _mm_stream_si128((__m128i*)dst, v);
+            _mm_stream_si128((__m128i*)dst + 1, v);
+            _mm_stream_si128((__m128i*)dst + 2, v);
+            _mm_stream_si128((__m128i*)dst + 3, v);
+        }
+        _mm_sfence();
+    } else
+        for (; n >= 16; n -= 16, dst += 16) {
+            _mm_store_si128((__m128i*)dst, v);
+            _mm_store_si128((__m128i*)dst + 1, v);
+            _mm_store_si128((__m128i*)dst + 2, v);
+            _mm_store_si128((__m128i*)dst + 3, v);
+        }
+    for (; n >= 4; n -= 4, dst += 4)
+        _mm_store_si128((__m128i*)dst, v);
+    while (n--)
+        *dst++ = col;
 }
 
-int RGBa(int c, uint8_t a) {
-    return (c & ~0x00FF0000) | (a << 24);
+PB_TARGET("avx2") static void fill_span_avx2(int *dst, int col, size_t n) {
+    for (; n && ((uintptr_t)dst & 31); n--)
+        *dst++ = col;
+    __m256i v = _mm256_set1_epi32(col);
+    if (n * sizeof(int) >= PB_STREAM_THRESHOLD) {
+        for (; n >= 32; n -= 32, dst += 32) {
+            _mm256_stream_si256((__m256i*)dst, v);
+            _mm256_stream_si256((__m256i*)dst + 1, v);
+            _mm256_stream_si256((__m256i*)dst + 2, v);
+            _mm256_stream_si256((__m256i*)dst + 3, v);
+        }
+        _mm_sfence();
+    } else
+        for (; n >= 32; n -= 32, dst += 32) {
+            _mm256_store_si256((__m256i*)dst, v);
+            _mm256_store_si256((__m256i*)dst + 1, v);
+            _mm256_store_si256((__m256i*)dst + 2, v);
+            _mm256_store_si256((__m256i*)dst + 3, v);
+        }
+    for (; n >= 8; n -= 8, dst += 8)
+        _mm256_store_si256((__m256i*)dst, v);
+    while (n--)
+        *dst++ = col;
 }
 
-pbImage* pbImageNew(unsigned int w, unsigned int h) {
-    pbImage *result = malloc(sizeof(pbImage));
+// 16-bit lanes: s * a + d * (255 - a), then the same exact x / 255 as blend_pixel
+PB_TARGET("sse2") static inline __m128i blend_lanes_sse2(__m128i s, __m128i d, __m128i a) {
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+PB_TARGET("sse2") static void blend_span_sse2(int *dst, const int *src, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32(0xFF000000);
+    const __m128i aone = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    for (; n >= 4; n -= 4, dst += 4, src += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)src);
+        __m128i a = _mm_and_si128(s, amask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, amask)) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)dst, s);
+            continue;
+        }
+        __m128i clear = _mm_cmpeq_epi32(a, zero);
+        if (_mm_movemask_epi8(clear) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)dst, zero);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        __m128i slo = _mm_unpacklo_epi8(s, zero), shi = _mm_unpackhi_epi8(s, zero);
+        __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+        __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+        __m128i lo = blend_lanes_sse2(_mm_or_si128(slo, aone), _mm_unpacklo_epi8(d, zero), alo);
+        __m128i hi = blend_lanes_sse2(_mm_or_si128(shi, aone), _mm_unpackhi_epi8(d, zero), ahi);
+        _mm_storeu_si128((__m128i*)dst, _mm_andnot_si128(clear, _mm_packus_epi16(lo, hi)));
+    }
+    blend_span_scalar(dst, src, n);
+}
+
+PB_TARGET("sse2") static void blend_fill_span_sse2(int *dst, int col, size_t n) {
+    int a = (unsigned int)col >> 24;
+    if (a == 255 || !a) {
+        blend_fill_span_scalar(dst, col, n);
+        return;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32(col | 0xFF000000), zero);
+    __m128i sa = _mm_add_epi16(_mm_mullo_epi16(s, _mm_set1_epi16(a)), _mm_set1_epi16(128));
+    __m128i ia = _mm_set1_epi16(255 - a);
+    for (; n >= 4; n -= 4, dst += 4) {
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        __m128i lo = _mm_add_epi16(sa, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia));
+        __m128i hi = _mm_add_epi16(sa, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(lo, hi));
+    }
+    blend_fill_span_scalar(dst, col, n);
+}
+
+PB_TARGET("sse2") static void blend_span_pm_sse2(int *dst, const int *src, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32(0xFF000000);
+    const __m128i c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+    for (; n >= 4; n -= 4, dst += 4, src += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)src);
+        __m128i a = _mm_and_si128(s, amask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, amask)) == 0xFFFF) {
+            _mm_storeu_si128((__m128i*)dst, s);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        __m128i slo = _mm_unpacklo_epi8(s, zero), shi = _mm_unpackhi_epi8(s, zero);
+        __m128i ilo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF));
+        __m128i ihi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ilo), c128);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ihi), c128);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        __m128i clear = _mm_cmpeq_epi32(a, zero);
+        _mm_storeu_si128((__m128i*)dst, _mm_andnot_si128(clear, _mm_adds_epu8(s, _mm_packus_epi16(lo, hi))));
+    }
+    blend_span_pm_scalar(dst, src, n);
+}
+
+PB_TARGET("avx2") static inline __m256i blend_lanes_avx2(__m256i s, __m256i d, __m256i a) {
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), a)));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+PB_TARGET("avx2") static void blend_span_avx2(int *dst, const int *src, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32(0xFF000000);
+    const __m256i aone = _mm256_set1_epi64x(0x00FF000000000000LL);
+    for (; n >= 8; n -= 8, dst += 8, src += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)src);
+        __m256i a = _mm256_and_si256(s, amask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, amask)) == -1) {
+            _mm256_storeu_si256((__m256i*)dst, s);
+            continue;
+        }
+        __m256i clear = _mm256_cmpeq_epi32(a, zero);
+        if (_mm256_movemask_epi8(clear) == -1) {
+            _mm256_storeu_si256((__m256i*)dst, zero);
+            continue;
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+        __m256i slo = _mm256_unpacklo_epi8(s, zero), shi = _mm256_unpackhi_epi8(s, zero);
+        __m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xFF), 0xFF);
+        __m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xFF), 0xFF);
+        __m256i lo = blend_lanes_avx2(_mm256_or_si256(slo, aone), _mm256_unpacklo_epi8(d, zero), alo);
+        __m256i hi = blend_lanes_avx2(_mm256_or_si256(shi, aone), _mm256_unpackhi_epi8(d, zero), ahi);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_andnot_si256(clear, _mm256_packus_epi16(lo, hi)));
+    }
+    blend_span_sse2(dst, src, n);
+}
+
+PB_TARGET("avx2") static void blend_span_pm_avx2(int *dst, const int *src, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32(0xFF000000);
+    const __m256i c255 = _mm256_set1_epi16(255), c128 = _mm256_set1_epi16(128);
+    for (; n >= 8; n -= 8, dst += 8, src += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)src);
+        __m256i a = _mm256_and_si256(s, amask);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, amask)) == -1) {
+            _mm256_storeu_si256((__m256i*)dst, s);
+            continue;
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+        __m256i slo = _mm256_unpacklo_epi8(s, zero), shi = _mm256_unpackhi_epi8(s, zero);
+        __m256i ilo = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, 0xFF), 0xFF));
+        __m256i ihi = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, 0xFF), 0xFF));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ilo), c128);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ihi), c128);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        __m256i clear = _mm256_cmpeq_epi32(a, zero);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_andnot_si256(clear, _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi))));
+    }
+    blend_span_pm_sse2(dst, src, n);
+}
+
+PB_TARGET("avx2") static void blend_fill_span_avx2(int *dst, int col, size_t n) {
+    int a = (unsigned int)col >> 24;
+    if (a == 255 || !a) {
+        blend_fill_span_scalar(dst, col, n);
+        return;
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i s = _mm256_unpacklo_epi8(_mm256_set1_epi32(col | 0xFF000000), zero);
+    __m256i sa = _mm256_add_epi16(_mm256_mullo_epi16(s, _mm256_set1_epi16(a)), _mm256_set1_epi16(128));
+    __m256i ia = _mm256_set1_epi16(255 - a);
+    for (; n >= 8; n -= 8, dst += 8) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)dst);
+        __m256i lo = _mm256_add_epi16(sa, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia));
+        __m256i hi = _mm256_add_epi16(sa, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_packus_epi16(lo, hi));
+    }
+    blend_fill_span_sse2(dst, col, n);
+}
+
+static int cpu_supports_avx2(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+    __cpuid(info, 1);
+    // AVX + OSXSAVE, then make sure the OS actually saves the YMM registers
+    if ((info[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28) || (_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+typedef struct {
+    void(*fill)(int*, int, size_t);
+    void(*blend)(int*, const int*, size_t);
+    void(*blend_fill)(int*, int, size_t);
+    void(*blend_pm)(int*, const int*, size_t);
+} span_table_t;
+
+static const span_table_t pbSpanScalar = {
+    fill_span_scalar, blend_span_scalar, blend_fill_span_scalar, blend_span_pm_scalar
+};
+#if defined(PB_SIMD_X86)
+static const span_table_t pbSpanSSE2 = {
+    fill_span_sse2, blend_span_sse2, blend_fill_span_sse2, blend_span_pm_sse2
+};
+static const span_table_t pbSpanAVX2 = {
+    fill_span_avx2, blend_span_avx2, blend_fill_span_avx2, blend_span_pm_avx2
+};
+#endif
+
+// Picked on first use, which can be from several threads at once. They all
+// pick the same table, so whichever store lands last doesn't matter
+static _Atomic(const span_table_t*) pbSpan = NULL;
+
+static const span_table_t* span_init(void) {
+    const span_table_t *table = &pbSpanScalar;
+#if defined(PB_SIMD_X86)
+    // SSE2 is part of the x86_64 baseline, only AVX2 needs checking
+    table = cpu_supports_avx2() ? &pbSpanAVX2 : &pbSpanSSE2;
+#endif
+    atomic_store_explicit(&pbSpan, table, memory_order_release);
+    return table;
+}
+
+static inline const span_table_t* spans(void) {
+    const span_table_t *table = atomic_load_explicit(&pbSpan, memory_order_acquire);
+    return table ? table : span_init();
+}
+
+static inline void fill_span(int *dst, int col, size_t n) {
+    spans()->fill(dst, col, n);
+}
+
+static inline void blend_span(int *dst, const int *src, size_t n) {
+    spans()->blend(dst, src, n);
+}
+
+static inline void blend_fill_span(int *dst, int col, size_t n) {
+    spans()->blend_fill(dst, col, n);
+}
+
+static inline void blend_span_pm(int *dst, const int *src, size_t n) {
+    spans()->blend_pm(dst, src, n);
+}
+
+static inline int* pixel_at(pbImage *img, int x, int y) {
+    return img->buffer + (size_t)y * img->stride + x;
+}
+
+static void* aligned_malloc(size_t size) {
+#if defined(_WIN32)
+    return _aligned_malloc(size, PB_ALIGNMENT);
+#else
+    void *result = NULL;
+    return posix_memalign(&result, PB_ALIGNMENT, size) ? NULL : result;
+#endif
+}
+
+static void aligned_free(void *ptr) {
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+// Size classes go up in quarter powers of two (4K, 5K, 6K, 7K, 8K, 10K, ...)
+// so a buffer never wastes more than 25%. Anything past the last class
+// (224M) skips the pool entirely
+#define PB_POOL_CLASSES 64
+#define PB_POOL_DEPTH 8
+
+static void* pool_alloc(pbAllocator *allocator, size_t size);
+static void pool_release(pbAllocator *allocator, void *ptr, size_t size);
+
+static struct {
+    pbAllocator allocator;
+    void *blocks[PB_POOL_CLASSES][PB_POOL_DEPTH];
+    int count[PB_POOL_CLASSES];
+} pbPool = { .allocator = { pool_alloc, pool_release } };
+
+static atomic_flag pbAllocLock = ATOMIC_FLAG_INIT;
+
+static inline void alloc_lock(void) {
+    while (atomic_flag_test_and_set_explicit(&pbAllocLock, memory_order_acquire))
+        ;
+}
+
+static inline void alloc_unlock(void) {
+    atomic_flag_clear_explicit(&pbAllocLock, memory_order_release);
+}
+
+static size_t pool_class_size(int c) {
+    return (size_t)(4 + (c & 3)) << (10 + (c >> 2));
+}
+
+static int pool_class(size_t size) {
+    for (int c = 0; c < PB_POOL_CLASSES; c++)
+        if (pool_class_size(c) >= size)
+            return c;
+    return -1;
+}
+
+// The lock only covers the pool's bookkeeping, the system allocator is
+// called outside of it
+static void* pool_alloc(pbAllocator *allocator, size_t size) {
+    int c = pool_class(size);
+    void *result = NULL;
+    alloc_lock();
+    if (c >= 0 && pbPool.count[c]) {
+        allocator->stats.poolHits++;
+        result = pbPool.blocks[c][--pbPool.count[c]];
+    } else
+        allocator->stats.poolMisses++;
+    alloc_unlock();
+    return result ? result : aligned_malloc(c < 0 ? size : pool_class_size(c));
+}
+
+static void pool_release(pbAllocator *allocator, void *ptr, size_t size) {
+    int c = pool_class(size), kept = 0;
+    alloc_lock();
+    if (c >= 0 && pbPool.count[c] < PB_POOL_DEPTH) {
+        pbPool.blocks[c][pbPool.count[c]++] = ptr;
+        kept = 1;
+    }
+    alloc_unlock();
+    if (!kept)
+        aligned_free(ptr);
+}
+
+pbAllocator* pbPoolAllocator(void) {
+    return &pbPool.allocator;
+}
+
+void pbPoolTrim(void) {
+    alloc_lock();
+    for (int c = 0; c < PB_POOL_CLASSES; c++)
+        while (pbPool.count[c])
+            aligned_free(pbPool.blocks[c][--pbPool.count[c]]);
+    alloc_unlock();
+}
+
+typedef struct {
+    pbAllocator allocator;
+    char *memory;
+    size_t capacity, offset;
+} pbArena;
+
+static void* arena_alloc(pbAllocator *allocator, size_t size) {
+    pbArena *arena = (pbArena*)allocator;
+    size = (size + PB_ALIGNMENT - 1) & ~(size_t)(PB_ALIGNMENT - 1);
+    void *result = NULL;
+    alloc_lock();
+    if (arena->offset + size <= arena->capacity) {
+        result = arena->memory + arena->offset;
+        arena->offset += size;
+    }
+    alloc_unlock();
+    return result;
+}
+
+static void arena_release(pbAllocator *allocator, void *ptr, size_t size) {
+    // Everything is given back at once by pbArenaReset
+}
+
+pbAllocator* pbArenaNew(size_t capacity) {
+    pbArena *arena = calloc(1, sizeof(pbArena));
+    if (!arena)
+        return NULL;
+    if (!(arena->memory = aligned_malloc(capacity))) {
+        free(arena);
+        return NULL;
+    }
+    arena->capacity = capacity;
+    arena->allocator.alloc = arena_alloc;
+    arena->allocator.release = arena_release;
+    return &arena->allocator;
+}
+
+void pbArenaReset(pbAllocator *allocator) {
+    pbArena *arena = (pbArena*)allocator;
+    alloc_lock();
+    arena->offset = 0;
+    arena->allocator.stats.bytesInUse = 0;
+    alloc_unlock();
+}
+
+void pbArenaFree(pbAllocator *allocator) {
+    pbArena *arena = (pbArena*)allocator;
+    if (arena) {
+        aligned_free(arena->memory);
+        free(arena);
+    }
+}
+
+static pbAllocator *pbCurrentAllocator = NULL;
+
+void pbSetAllocator(pbAllocator *allocator) {
+    pbCurrentAllocator = allocator;
+}
+
+#if defined(PB_THREADS)
+// One per pbParallelFor call, lives on the dispatching thread's stack
+typedef struct {
+    pbJob job;
+    void *userdata;
+    int count;
+    atomic_int next;
+} workers_job_t;
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t dispatch, lock;
+    pthread_cond_t wake, done;
+    int workers, active;
+    unsigned int generation;
+    // NULL between dispatches, so a worker that wakes late can't pick up a
+    // job whose caller has already returned
+    workers_job_t *current;
+} pbWorkers = {
+    .once = PTHREAD_ONCE_INIT,
+    .dispatch = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+static _Thread_local int pbInsideJob = 0;
+
+static void workers_drain(workers_job_t *work) {
+    int i;
+    pbInsideJob = 1;
+    while ((i = atomic_fetch_add(&work->next, 1)) < work->count)
+        work->job(work->userdata, i);
+    pbInsideJob = 0;
+}
+
+static void* worker_main(void *arg) {
+    unsigned int seen = 0;
+    pthread_mutex_lock(&pbWorkers.lock);
+    for (;;) {
+        while (pbWorkers.generation == seen)
+            pthread_cond_wait(&pbWorkers.wake, &pbWorkers.lock);
+        seen = pbWorkers.generation;
+        workers_job_t *work = pbWorkers.current;
+        if (!work)
+            continue;
+        pbWorkers.active++;
+        pthread_mutex_unlock(&pbWorkers.lock);
+
+        workers_drain(work);
+
+        pthread_mutex_lock(&pbWorkers.lock);
+        if (!--pbWorkers.active)
+            pthread_cond_signal(&pbWorkers.done);
+    }
+    return NULL;
+}
+
+static void workers_init(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus > 1 ? (int)cpus - 1 : 0;
+    if (n > PB_MAX_WORKERS)
+        n = PB_MAX_WORKERS;
+    for (int i = 0; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL))
+            break;
+        pthread_detach(thread);
+        pbWorkers.workers++;
+    }
+}
+
+static void workers_dispatch(pbJob job, void *userdata, int count) {
+    pthread_once(&pbWorkers.once, workers_init);
+    // Nested calls from inside a job run inline instead of deadlocking
+    if (!pbWorkers.workers || count == 1 || pbInsideJob) {
+        for (int i = 0; i < count; i++)
+            job(userdata, i);
+        return;
+    }
+
+    workers_job_t work = { job, userdata, count };
+    atomic_init(&work.next, 0);
+    pthread_mutex_lock(&pbWorkers.dispatch);
+    pthread_mutex_lock(&pbWorkers.lock);
+    pbWorkers.current = &work;
+    pbWorkers.generation++;
+    pthread_cond_broadcast(&pbWorkers.wake);
+    pthread_mutex_unlock(&pbWorkers.lock);
+
+    workers_drain(&work);
+
+    // Every index has been claimed, wait for the ones still running. Workers
+    // only join while holding the lock, so once current is cleared here no
+    // one else can reach work
+    pthread_mutex_lock(&pbWorkers.lock);
+    while (pbWorkers.active)
+        pthread_cond_wait(&pbWorkers.done, &pbWorkers.lock);
+    pbWorkers.current = NULL;
+    pthread_mutex_unlock(&pbWorkers.lock);
+    pthread_mutex_unlock(&pbWorkers.dispatch);
+}
+#else
+static void workers_dispatch(pbJob job, void *userdata, int count) {
+    for (int i = 0; i < count; i++)
+        job(userdata, i);
+}
+#endif
+
+static pbDispatcher pbCurrentDispatcher = NULL;
+
+void pbSetDispatcher(pbDispatcher dispatcher) {
+    pbCurrentDispatcher = dispatcher;
+}
+
+void pbParallelFor(int count, pbJob job, void *userdata) {
+    if (count > 0)
+        (pbCurrentDispatcher ? pbCurrentDispatcher : workers_dispatch)(job, userdata, count);
+}
+
+static struct {
+    pbSpawner spawn;
+    pbWaiter wait;
+} pbTasks = {0};
+
+void pbSetTaskSystem(pbSpawner spawn, pbWaiter wait) {
+    pbTasks.spawn = spawn;
+    pbTasks.wait = wait;
+}
+
+pbTask* pbSpawn(int count, pbJob job, void *userdata) {
+    if (pbTasks.spawn && pbTasks.wait)
+        return pbTasks.spawn(count, job, userdata);
+    pbParallelFor(count, job, userdata);
+    return NULL;
+}
+
+void pbWait(pbTask *task) {
+    if (task && pbTasks.wait)
+        pbTasks.wait(task);
+}
+
+// The header lives in the same block as the pixels, padded so the
+// buffer starts on its own cache line
+#define PB_IMAGE_HEADER ((sizeof(pbImage) + PB_ALIGNMENT - 1) & ~(size_t)(PB_ALIGNMENT - 1))
+
+// Rows are padded to a whole number of cache lines so every row is aligned
+#define PB_ROW_PIXELS (PB_ALIGNMENT / sizeof(int))
+
+static unsigned int image_stride(unsigned int w) {
+    return (w + PB_ROW_PIXELS - 1) & ~(unsigned int)(PB_ROW_PIXELS - 1);
+}
+
+static size_t image_size(unsigned int w, unsigned int h) {
+    return PB_IMAGE_HEADER + (size_t)image_stride(w) * h * sizeof(int);
+}
+
+// Allocators are called without holding the lock, custom ones can be slow
+// (X11's talks to the server), it's only taken to update the stats
+static void* image_alloc(pbAllocator **allocator, size_t size) {
+    pbAllocator *a = *allocator;
+    void *result = a->alloc(a, size);
+    // A full arena fails outright, its images are never freed one by one so
+    // anything moved to the pool would leak
+    if (!result && a != pbPoolAllocator() && a->alloc != arena_alloc) {
+        // A custom allocator failed, fall back to the pool
+        alloc_lock();
+        a->stats.poolMisses++;
+        alloc_unlock();
+        a = *allocator = pbPoolAllocator();
+        result = a->alloc(a, size);
+    }
+    if (!result)
+        return NULL;
+    alloc_lock();
+    a->stats.allocations++;
+    a->stats.bytesInUse += size;
+    if (a->stats.bytesInUse > a->stats.peakBytes)
+        a->stats.peakBytes = a->stats.bytesInUse;
+    alloc_unlock();
+    return result;
+}
+
+static void image_release(pbAllocator *allocator, void *ptr, size_t size) {
+    allocator->release(allocator, ptr, size);
+    alloc_lock();
+    allocator->stats.releases++;
+    allocator->stats.bytesInUse -= size;
+    alloc_unlock();
+}
+
+static pbImage* image_new(pbAllocator *allocator, unsigned int w, unsigned int h) {
+    pbImage *result = image_alloc(&allocator, image_size(w, h));
+    if (!result)
+        return NULL;
     result->width = w;
     result->height = h;
-    result->buffer = malloc(w * h * sizeof(int));
+    result->stride = image_stride(w);
+    result->buffer = (int*)((char*)result + PB_IMAGE_HEADER);
+    result->format = pbFormatStraight;
+    result->allocator = allocator;
+    result->parent = NULL;
+    result->parentX = result->parentY = 0;
+    result->trackDirty = result->dirtyCount = 0;
+    result->batched = 0;
     return result;
 }
 
+pbImage* pbImageNew(unsigned int w, unsigned int h) {
+    return image_new(pbCurrentAllocator ? pbCurrentAllocator : pbPoolAllocator(), w, h);
+}
+
 void pbImageFree(pbImage *img) {
-    if (img) {
-        if (img->buffer)
-            free(img->buffer);
+    // Arena images go back with pbArenaReset
+    if (!img || (!img->parent && img->allocator->alloc == arena_alloc))
+        return;
+    if (img->parent)
         free(img);
-    }
+    else
+        image_release(img->allocator, img, image_size(img->width, img->height));
 }
 
-void pbImageFill(pbImage *img, int col) {
-    for (int i = 0; i < img->width * img->height; ++i)
-        img->buffer[i] = col;
+static inline pbImage* image_root(pbImage *img) {
+    while (img->parent)
+        img = img->parent;
+    return img;
 }
 
-static inline void flood_fn(pbImage *img, int x, int y, int new, int old) {
-    if (new == old || pbImagePGet(img, x, y) != old)
+// Picked by address so unrelated images don't wait on each other
+#define PB_DIRTY_LOCKS 16
+static atomic_int pbDirtyLocks[PB_DIRTY_LOCKS];
+
+static inline atomic_int* dirty_lock_for(pbImage *img) {
+    return &pbDirtyLocks[((uintptr_t)img / sizeof(pbImage)) % PB_DIRTY_LOCKS];
+}
+
+static inline void dirty_lock(pbImage *img) {
+    while (atomic_exchange_explicit(dirty_lock_for(img), 1, memory_order_acquire))
+        ;
+}
+
+static inline void dirty_unlock(pbImage *img) {
+    atomic_store_explicit(dirty_lock_for(img), 0, memory_order_release);
+}
+
+static inline long long rect_area(pbRect r) {
+    return (long long)r.w * r.h;
+}
+
+static inline int rect_contains(pbRect a, pbRect b) {
+    return b.x >= a.x && b.y >= a.y && b.x + b.w <= a.x + a.w && b.y + b.h <= a.y + a.h;
+}
+
+// Rects that share an edge count as overlapping too
+static inline int rect_overlaps(pbRect a, pbRect b) {
+    return a.x <= b.x + b.w && b.x <= a.x + a.w && a.y <= b.y + b.h && b.y <= a.y + a.h;
+}
+
+static inline pbRect rect_union(pbRect a, pbRect b) {
+    int x0 = a.x < b.x ? a.x : b.x, y0 = a.y < b.y ? a.y : b.y;
+    int x1 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+    int y1 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+    return (pbRect) { x0, y0, x1 - x0, y1 - y0 };
+}
+
+static inline pbRect rect_clip(pbRect a, pbRect b) {
+    int x0 = a.x > b.x ? a.x : b.x, y0 = a.y > b.y ? a.y : b.y;
+    int x1 = a.x + a.w < b.x + b.w ? a.x + a.w : b.x + b.w;
+    int y1 = a.y + a.h < b.y + b.h ? a.y + a.h : b.y + b.h;
+    return (pbRect) { x0, y0, x1 - x0, y1 - y0 };
+}
+
+static void dirty_add(pbImage *img, pbRect r) {
+    for (int i = img->dirtyCount - 1; i >= 0; i--)
+        if (rect_contains(img->dirty[i], r))
+            return;
+    if (img->dirtyCount) {
+        // Spans drawn one row after another just grow the last rect
+        pbRect *last = &img->dirty[img->dirtyCount - 1];
+        pbRect u = rect_union(*last, r);
+        if (rect_area(u) <= rect_area(*last) + rect_area(r)) {
+            *last = u;
+            return;
+        }
+    }
+    if (img->dirtyCount < PB_MAX_DIRTY) {
+        img->dirty[img->dirtyCount++] = r;
         return;
+    }
+    // Out of slots, grow whichever rect ends up the least bigger
+    int best = 0;
+    long long cost = -1;
+    for (int i = 0; i < img->dirtyCount; i++) {
+        long long c = rect_area(rect_union(img->dirty[i], r)) - rect_area(img->dirty[i]);
+        if (cost < 0 || c < cost) {
+            cost = c;
+            best = i;
+        }
+    }
+    img->dirty[best] = rect_union(img->dirty[best], r);
+}
 
-    int x1 = x;
-    while (x1 < img->width && pbImagePGet(img, x1, y) == old) {
-        pbImagePSet(img, x1, y, new);
-        x1++;
+void pbImageTouchRect(pbImage *img, int x, int y, int w, int h) {
+    for (; img->parent && !img->batched; img = img->parent) {
+        x += img->parentX;
+        y += img->parentY;
+    }
+    pbRect r = rect_clip((pbRect) { x, y, w, h }, (pbRect) { 0, 0, img->width, img->height });
+    if (img->batched) {
+        // A tile belongs to one thread, nothing shared is touched until it ends
+        if (r.w > 0 && r.h > 0) {
+            img->dirty[0] = img->dirtyCount ? rect_union(img->dirty[0], r) : r;
+            img->dirtyCount = 1;
+        }
+        return;
+    }
+    if (!img->trackDirty || r.w <= 0 || r.h <= 0)
+        return;
+    dirty_lock(img);
+    dirty_add(img, r);
+    dirty_unlock(img);
+}
+
+void pbImageTouch(pbImage *img) {
+    pbImageTouchRect(img, 0, 0, img->width, img->height);
+}
+
+void pbImageTrackDirty(pbImage *img, int enable) {
+    img = image_root(img);
+    img->trackDirty = enable;
+    // Nothing is known about what was drawn before, so start fully dirty
+    img->dirtyCount = !!enable;
+    img->dirty[0] = (pbRect) { 0, 0, img->width, img->height };
+}
+
+int pbImageDirtyRects(pbImage *img, pbRect **rects) {
+    img = image_root(img);
+    dirty_lock(img);
+    for (int merged = 1; merged;) {
+        merged = 0;
+        for (int i = 0; i < img->dirtyCount; i++)
+            for (int j = i + 1; j < img->dirtyCount; j++)
+                if (rect_overlaps(img->dirty[i], img->dirty[j])) {
+                    img->dirty[i] = rect_union(img->dirty[i], img->dirty[j]);
+                    img->dirty[j--] = img->dirty[--img->dirtyCount];
+                    merged = 1;
+                }
     }
+    dirty_unlock(img);
+    if (rects)
+        *rects = img->dirty;
+    return img->dirtyCount;
+}
+
+void pbImageClearDirty(pbImage *img) {
+    image_root(img)->dirtyCount = 0;
+}
 
-    x1 = x - 1;
-    while (x1 >= 0 && pbImagePGet(img, x1, y) == old) {
-        pbImagePSet(img, x1, y, new);
-        x1--;
+// Scanned every time rather than cached, scenes are free to write to buffer
+// without telling pb. Stops after the first row with a translucent pixel
+static int image_opaque(pbImage *img, int rx, int ry, int rw, int rh) {
+    unsigned int acc = 0xFFFFFFFF;
+    for (int y = ry; y < ry + rh && acc >= 0xFF000000; y++) {
+        unsigned int *row = (unsigned int*)pixel_at(img, rx, y);
+        for (int x = 0; x < rw; x++)
+            acc &= row[x];
     }
+    return acc >= 0xFF000000;
+}
 
-    x1 = x;
-    while (x1 < img->width && pbImagePGet(img, x1, y) == new) {
-        if(y > 0 && pbImagePGet(img, x1, y - 1) == old)
-            flood_fn(img, x1, y - 1, new, old);
-        x1++;
+void pbImageConvert(pbImage *img, pbFormat format) {
+    if (img->format == format)
+        return;
+    for (int y = 0; y < img->height; y++) {
+        int *row = pixel_at(img, 0, y);
+        if (format == pbFormatPremultiplied)
+            for (int x = 0; x < img->width; x++)
+                row[x] = premultiply_pixel(row[x]);
+        else
+            for (int x = 0; x < img->width; x++)
+                row[x] = unpremultiply_pixel(row[x]);
     }
+    img->format = format;
+    pbImageTouch(img);
+}
 
-    x1 = x - 1;
-    while(x1 >= 0 && pbImagePGet(img, x1, y) == new) {
-        if(y > 0 && pbImagePGet(img, x1, y - 1) == old)
-            flood_fn(img, x1, y - 1, new, old);
-        x1--;
+void pbImageFill(pbImage *img, int col) {
+    if (!img->width || !img->height)
+        return;
+    pbImageTouch(img);
+    // Row padding of an image that owns its buffer can be filled too, so
+    // the whole thing goes as one span unless it's a view into something else
+    if (!img->parent || img->stride == img->width)
+        fill_span(img->buffer, col, (size_t)img->stride * (img->height - 1) + img->width);
+    else
+        for (int y = 0; y < img->height; y++)
+            fill_span(pixel_at(img, 0, y), col, img->width);
+}
+
+void pbImageFillSpan(pbImage *img, int x, int y, int w, int col) {
+    if (y < 0 || y >= img->height || w <= 0)
+        return;
+    if (x < 0) {
+        w += x;
+        x  = 0;
+    }
+    if (x + w > (int)img->width)
+        w = img->width - x;
+    if (w > 0) {
+        fill_span(pixel_at(img, x, y), col, w);
+        pbImageTouchRect(img, x, y, w, 1);
     }
+}
 
-    x1 = x;
-    while(x1 < img->width && pbImagePGet(img, x1, y) == new) {
-        if(y < img->height - 1 && pbImagePGet(img, x1, y + 1) == old)
-            flood_fn(img, x1, y + 1, new, old);
-        x1++;
+void pbImageBlendSpan(pbImage *img, int x, int y, const int *src, int n) {
+    if (y < 0 || y >= img->height || n <= 0)
+        return;
+    if (x < 0) {
+        src -= x;
+        n   += x;
+        x    = 0;
     }
+    if (x + n > (int)img->width)
+        n = img->width - x;
+    if (n <= 0)
+        return;
+    if (img->format == pbFormatPremultiplied) {
+        int tmp[256];
+        for (int i = 0; i < n; i += 256) {
+            int m = n - i < 256 ? n - i : 256;
+            for (int j = 0; j < m; j++)
+                tmp[j] = premultiply_pixel(src[i + j]);
+            blend_span_pm(pixel_at(img, x + i, y), tmp, m);
+        }
+    } else
+        blend_span(pixel_at(img, x, y), src, n);
+    pbImageTouchRect(img, x, y, n, 1);
+}
+
+static void flood_fn(pbImage *img, int x, int y, int new, int old) {
+    if (new == old || pbImagePGet(img, x, y) != old)
+        return;
+
+    int *row = pixel_at(img, 0, y);
+    int x0 = x, x1 = x;
+    while (x0 > 0 && row[x0 - 1] == old)
+        x0--;
+    while (x1 < img->width - 1 && row[x1 + 1] == old)
+        x1++;
+    fill_span(row + x0, new, x1 - x0 + 1);
 
-    x1 = x - 1;
-    while(x1 >= 0 && pbImagePGet(img, x1, y) == new) {
-        if(y < img->height - 1 && pbImagePGet(img, x1, y + 1) == old)
-            flood_fn(img, x1, y + 1, new, old);
-        x1--;
+    for (x = x0; x <= x1; x++) {
+        if (y > 0 && pbImagePGet(img, x, y - 1) == old)
+            flood_fn(img, x, y - 1, new, old);
+        if (y < img->height - 1 && pbImagePGet(img, x, y + 1) == old)
+            flood_fn(img, x, y + 1, new, old);
     }
 }
 
@@ -421,70 +1571,222 @@ void pbImageFlood(pbImage *img, int x, int y, int col) {
     if (x < 0 || y < 0 || x >= img->width || y >= img->height)
         return;
     flood_fn(img, x, y, col, pbImagePGet(img, x, y));
+    pbImageTouch(img);
 }
 
-#define BLEND(c0, c1, a0, a1) (c0 * a0 / 255) + (c1 * a1 * (255 - a0) / 65025)
+static inline void plot(pbImage *img, int x, int y, int col, int opaque) {
+    int *p = pixel_at(img, x, y);
+    *p = opaque ? col : blend_into(img->format, *p, col);
+}
 
-static int Blend(int _a, int _b) {
-    int a   = rgbA(_a);
-    int b   = rgbA(_b);
-    return !a ? 0xFF000000 : a >= 255 ? RGBa(a, 255) : RGBA(BLEND(Rgba(_a), Rgba(_b), a, b),
-                                                            BLEND(rGba(_a), rGba(_b), a, b),
-                                                            BLEND(rgBa(_a), rgBa(_b), a, b),
-                                                            a + (b * (255 - a) >> 8));
+// pbImagePSet without the touch, for shapes that mark their bounds once
+static inline void pset(pbImage *img, int x, int y, int col) {
+    if (x >= 0 && y >= 0 && x < img->width && y < img->height)
+        plot(img, x, y, col, 0);
 }
 
 void pbImagePSet(pbImage *img, int x, int y, int col) {
     if (x >= 0 && y >= 0 && x < img->width && y < img->height) {
-        int a = rgbA(col);
-        img->buffer[y * img->width + x] = a == 255 ? col : a == 0 ? 0 : Blend(pbImagePGet(img, x, y), col);
+        plot(img, x, y, col, 0);
+        pbImageTouchRect(img, x, y, 1, 1);
     }
 }
 
 int pbImagePGet(pbImage *img, int x, int y) {
-    return (x >= 0 && y >= 0 && x < img->width && y < img->height) ? img->buffer[y * img->width + x] : 0;
+    return (x >= 0 && y >= 0 && x < img->width && y < img->height) ? *pixel_at(img, x, y) : 0;
 }
 
-void pbImagePaste(pbImage *dst, pbImage *src, int x, int y) {
-    for (int ox = 0; ox < src->width; ++ox) {
-        for (int oy = 0; oy < src->height; ++oy) {
-            if (oy > dst->height)
-                break;
-            pbImagePSet(dst, x + ox, y + oy, pbImagePGet(src, ox, oy));
+// box is x0, y0, x1, y1 and grows to take in (x, y)
+static inline void box_add(int *box, int x, int y) {
+    if (x < box[0])
+        box[0] = x;
+    if (y < box[1])
+        box[1] = y;
+    if (x > box[2])
+        box[2] = x;
+    if (y > box[3])
+        box[3] = y;
+}
+
+#if defined(PB_SIMD_X86)
+// Clips four points per iteration, returns how many points were handled
+PB_TARGET("sse2") static int pset_batch_sse2(pbImage *img, const int *xy, const int *cols, int n, int opaque, int *box) {
+    // Flipping the sign bit turns the signed compare into an unsigned one,
+    // so negative coordinates fail the same test as ones past the edge
+    const __m128i flip = _mm_set1_epi32((int)0x80000000);
+    const __m128i bounds = _mm_xor_si128(_mm_setr_epi32(img->width, img->height, img->width, img->height), flip);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(xy + i * 2)), flip);
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(xy + i * 2 + 4)), flip);
+        int inside = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(a, bounds))) |
+                     _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(b, bounds))) << 4;
+        inside &= inside >> 1;
+        for (int j = 0; inside; j++, inside >>= 2)
+            if (inside & 1) {
+                plot(img, xy[(i + j) * 2], xy[(i + j) * 2 + 1], cols[i + j], opaque);
+                box_add(box, xy[(i + j) * 2], xy[(i + j) * 2 + 1]);
+            }
+    }
+    return i;
+}
+#endif
+
+static void pset_batch(pbImage *img, const int *xy, const int *cols, int n, int opaque) {
+    // Only the area around the points that landed is touched, none is empty
+    int i = 0, box[4] = { img->width, img->height, -1, -1 };
+#if defined(PB_SIMD_X86)
+    i = pset_batch_sse2(img, xy, cols, n, opaque, box);
+#endif
+    for (; i < n; i++)
+        if ((unsigned int)xy[i * 2] < img->width && (unsigned int)xy[i * 2 + 1] < img->height) {
+            plot(img, xy[i * 2], xy[i * 2 + 1], cols[i], opaque);
+            box_add(box, xy[i * 2], xy[i * 2 + 1]);
         }
-        if (ox > dst->width)
-            break;
+    if (box[2] >= 0)
+        pbImageTouchRect(img, box[0], box[1], box[2] - box[0] + 1, box[3] - box[1] + 1);
+}
+
+void pbImagePSetBatch(pbImage *img, const int *xy, const int *cols, int n) {
+    pset_batch(img, xy, cols, n, 0);
+}
+
+void pbImagePSetBatchOpaque(pbImage *img, const int *xy, const int *cols, int n) {
+    pset_batch(img, xy, cols, n, 1);
+}
+
+static void blit(pbImage *dst, pbImage *src, int x, int y, int rx, int ry, int rw, int rh) {
+    if (rx < 0) {
+        x  -= rx;
+        rw += rx;
+        rx  = 0;
+    }
+    if (ry < 0) {
+        y  -= ry;
+        rh += ry;
+        ry  = 0;
+    }
+    if (x < 0) {
+        rx -= x;
+        rw += x;
+        x   = 0;
     }
+    if (y < 0) {
+        ry -= y;
+        rh += y;
+        y   = 0;
+    }
+    if (rx + rw > (int)src->width)
+        rw = src->width - rx;
+    if (ry + rh > (int)src->height)
+        rh = src->height - ry;
+    if (x + rw > (int)dst->width)
+        rw = dst->width - x;
+    if (y + rh > (int)dst->height)
+        rh = dst->height - y;
+    if (rw <= 0 || rh <= 0)
+        return;
+
+    // Views of the same image can overlap, rows are then copied in whichever
+    // order never reads a row that was already written over, and each row
+    // goes through a copy before it is blended
+    int shared = image_root(dst) == image_root(src);
+    int step = 1, oy = 0;
+    if (shared && pixel_at(dst, x, y) > pixel_at(src, rx, ry)) {
+        step = -1;
+        oy = rh - 1;
+    }
+    // Opaque pixels are the same in either format and replace whatever is
+    // underneath, so those sources are a straight copy
+    if (image_opaque(src, rx, ry, rw, rh)) {
+        for (int i = 0; i < rh; i++, oy += step)
+            memmove(pixel_at(dst, x, y + oy), pixel_at(src, rx, ry + oy), rw * sizeof(int));
+    } else {
+        // Blended in the destination's format, rows from a source in the
+        // other format are converted into the copy first
+        void(*blend)(int*, const int*, size_t) = dst->format == pbFormatPremultiplied ? blend_span_pm : blend_span;
+        int convert = src->format != dst->format;
+        int *copy = shared || convert ? malloc(rw * sizeof(int)) : NULL;
+        if ((shared || convert) && !copy)
+            return;
+        for (int i = 0; i < rh; i++, oy += step) {
+            const int *row = pixel_at(src, rx, ry + oy);
+            if (convert) {
+                for (int j = 0; j < rw; j++)
+                    copy[j] = dst->format == pbFormatPremultiplied ? premultiply_pixel(row[j]) : unpremultiply_pixel(row[j]);
+                row = copy;
+            } else if (copy)
+                row = memcpy(copy, row, rw * sizeof(int));
+            blend(pixel_at(dst, x, y + oy), row, rw);
+        }
+        free(copy);
+    }
+    pbImageTouchRect(dst, x, y, rw, rh);
+}
+
+void pbImagePaste(pbImage *dst, pbImage *src, int x, int y) {
+    blit(dst, src, x, y, 0, 0, src->width, src->height);
 }
 
 void pbImageClippedPaste(pbImage *dst, pbImage *src, int x, int y, int rx, int ry, int rw, int rh) {
-    for (int ox = 0; ox < rw; ++ox)
-        for (int oy = 0; oy < rh; ++oy)
-            pbImagePSet(dst, ox + x, oy + y, pbImagePGet(src, ox + rx, oy + ry));
+    blit(dst, src, x, y, rx, ry, rw, rh);
 }
 
 pbImage* pbImageDupe(pbImage *src) {
     pbImage *result = pbImageNew(src->width, src->height);
-    memcpy(result->buffer, src->buffer, src->width * src->height * sizeof(int));
+    if (!result)
+        return NULL;
+    for (int y = 0; y < src->height; y++)
+        memcpy(pixel_at(result, 0, y), pixel_at(src, 0, y), src->width * sizeof(int));
+    result->format = src->format;
     return result;
 }
 
 void pbImagePassThru(pbImage *img, int(*fn)(int x, int y, int col)) {
-    int x, y;
-    for (x = 0; x < img->width; ++x)
-        for (y = 0; y < img->height; ++y)
-            img->buffer[y * img->width + x] = fn(x, y, pbImagePGet(img, x, y));
+    for (int y = 0; y < img->height; y++) {
+        int *row = pixel_at(img, 0, y);
+        for (int x = 0; x < img->width; x++)
+            row[x] = fn(x, y, row[x]);
+    }
+    pbImageTouch(img);
+}
+
+typedef struct {
+    pbImage *img;
+    int(*fn)(int x, int y, int col);
+} passthru_t;
+
+static void passthru_band(void *userdata, int band) {
+    passthru_t *job = (passthru_t*)userdata;
+    int y0 = band * PB_BAND_ROWS;
+    int y1 = y0 + PB_BAND_ROWS;
+    if (y1 > (int)job->img->height)
+        y1 = job->img->height;
+    for (int y = y0; y < y1; y++) {
+        int *row = pixel_at(job->img, 0, y);
+        for (int x = 0; x < job->img->width; x++)
+            row[x] = job->fn(x, y, row[x]);
+    }
+}
+
+void pbImageParallelPassThru(pbImage *img, int(*fn)(int x, int y, int col)) {
+    passthru_t job = { img, fn };
+    pbParallelFor((img->height + PB_BAND_ROWS - 1) / PB_BAND_ROWS, passthru_band, &job);
+    pbImageTouch(img);
 }
 
 pbImage* pbImageResized(pbImage *src, int nw, int nh) {
     pbImage *result = pbImageNew(nw, nh);
+    if (!result)
+        return NULL;
+    result->format = src->format;
     int x_ratio = (int)((src->width << 16) / result->width) + 1;
     int y_ratio = (int)((src->height << 16) / result->height) + 1;
     int x2, y2, i, j;
     for (i = 0; i < result->height; ++i) {
-        int *t = result->buffer + i * result->width;
+        int *t = pixel_at(result, 0, i);
         y2 = ((i * y_ratio) >> 16);
-        int *p = src->buffer + y2 * src->width;
+        int *p = pixel_at(src, 0, y2);
         int rat = 0;
         for (j = 0; j < result->width; ++j) {
             x2 = (rat >> 16);
@@ -503,7 +1805,7 @@ pbImage* pbImageRotated(pbImage *src, float angle) {
     float theta = __D2R(angle);
     float c = cosf(theta), s = sinf(theta);
     float r[3][2] = {
-        { -src->height * s, src->height * c },
+        { -(float)src->height * s, src->height * c },
         {  src->width * c - src->height * s, src->height * c + src->width * s },
         {  src->width * c, src->width * s }
     };
@@ -519,6 +1821,10 @@ pbImage* pbImageRotated(pbImage *src, float angle) {
     int dw = (int)ceil(fabsf(mm[1][0]) - mm[0][0]);
     int dh = (int)ceil(fabsf(mm[1][1]) - mm[0][1]);
     pbImage *result = pbImageNew(dw, dh);
+    if (!result)
+        return NULL;
+    pbImageFill(result, 0);
+    result->format = src->format;
 
     int x, y, sx, sy;
     for (x = 0; x < dw; ++x)
@@ -527,34 +1833,104 @@ pbImage* pbImageRotated(pbImage *src, float angle) {
             sy = ((y + mm[0][1]) * c - (x + mm[0][0]) * s);
             if (sx < 0 || sx >= src->width || sy < 0 || sy >= src->height)
                 continue;
-            pbImagePSet(result, x, y, pbImagePGet(src, sx, sy));
+            *pixel_at(result, x, y) = *pixel_at(src, sx, sy);
         }
     return result;
 }
 
 #define __CLAMP(X, MINX, MAXX) __MIN(__MAX((X), (MINX)), (MAXX))
 
-pbImage* pbImageClipped(pbImage *src, int rx, int ry, int rw, int rh) {
-    int ox = __CLAMP(rx, 0, src->width);
-    int oy = __CLAMP(ry, 0, src->height);
+static int clip_rect(pbImage *src, int *rx, int *ry, int *rw, int *rh) {
+    int ox = __CLAMP(*rx, 0, (int)src->width);
+    int oy = __CLAMP(*ry, 0, (int)src->height);
     if (ox >= src->width || oy >= src->height)
+        return 0;
+    int mx = __MIN(ox + *rw, (int)src->width);
+    int my = __MIN(oy + *rh, (int)src->height);
+    *rx = ox;
+    *ry = oy;
+    *rw = mx - ox;
+    *rh = my - oy;
+    return *rw > 0 && *rh > 0;
+}
+
+pbImage* pbImageClipped(pbImage *src, int rx, int ry, int rw, int rh) {
+    if (!clip_rect(src, &rx, &ry, &rw, &rh))
         return NULL;
-    int mx = __MIN(ox + rw, src->width);
-    int my = __MIN(oy + rh, src->height);
-    int iw = mx - ox;
-    int ih = my - oy;
-    if (iw <= 0 || ih <= 0)
+    pbImage *result = pbImageNew(rw, rh);
+    if (!result)
         return NULL;
-    pbImage *result = pbImageNew(iw, ih);
-    for (int px = 0; px < iw; px++)
-        for (int py = 0; py < ih; py++) {
-            int cx = ox + px;
-            int cy = oy + py;
-            pbImagePSet(result, px, py, pbImagePGet(src, cx, cy));
-        }
+    result->format = src->format;
+    for (int py = 0; py < rh; py++)
+        memcpy(pixel_at(result, 0, py), pixel_at(src, rx, ry + py), rw * sizeof(int));
+    return result;
+}
+
+static int view_init(pbImage *view, pbImage *src, int rx, int ry, int rw, int rh) {
+    if (!clip_rect(src, &rx, &ry, &rw, &rh))
+        return 0;
+    view->width = rw;
+    view->height = rh;
+    view->stride = src->stride;
+    view->buffer = pixel_at(src, rx, ry);
+    view->format = src->format;
+    view->allocator = NULL;
+    view->parent = src;
+    view->parentX = rx;
+    view->parentY = ry;
+    view->trackDirty = view->dirtyCount = 0;
+    view->batched = 0;
+    return 1;
+}
+
+pbImage* pbImageView(pbImage *src, int rx, int ry, int rw, int rh) {
+    pbImage *result = malloc(sizeof(pbImage));
+    if (!result)
+        return NULL;
+    if (!view_init(result, src, rx, ry, rw, rh)) {
+        free(result);
+        return NULL;
+    }
     return result;
 }
 
+typedef struct {
+    pbImage *img;
+    int tileW, tileH, columns;
+    pbTileFn fn;
+    void *userdata;
+} tiles_t;
+
+static void tiles_job(void *userdata, int index) {
+    tiles_t *job = (tiles_t*)userdata;
+    int x = (index % job->columns) * job->tileW;
+    int y = (index / job->columns) * job->tileH;
+    // Lives on the stack, no point allocating a view per tile
+    pbImage tile;
+    if (!view_init(&tile, job->img, x, y, job->tileW, job->tileH))
+        return;
+    tile.batched = 1;
+    job->fn(&tile, x, y, job->userdata);
+    // Everything the tile touched goes to the image in one go
+    if (tile.dirtyCount)
+        pbImageTouchRect(job->img, x + tile.dirty[0].x, y + tile.dirty[0].y, tile.dirty[0].w, tile.dirty[0].h);
+}
+
+void pbImageParallelTiles(pbImage *img, int tileW, int tileH, pbTileFn fn, void *userdata) {
+    if (!img || !fn || !img->width || !img->height)
+        return;
+    tiles_t job = {
+        .img = img,
+        .tileW = tileW > 0 ? tileW : PB_TILE_SIZE,
+        .tileH = tileH > 0 ? tileH : PB_TILE_SIZE,
+        .fn = fn,
+        .userdata = userdata
+    };
+    job.columns = (img->width + job.tileW - 1) / job.tileW;
+    int rows = (img->height + job.tileH - 1) / job.tileH;
+    pbParallelFor(job.columns * rows, tiles_job, &job);
+}
+
 static inline void vline(pbImage *img, int x, int y0, int y1, int col) {
     if (y1 < y0) {
         y0 += y1;
@@ -562,16 +1938,21 @@ static inline void vline(pbImage *img, int x, int y0, int y1, int col) {
         y0 -= y1;
     }
 
-    if (x < 0 || x >= img->width || y0 >= img->height)
+    if (x < 0 || x >= (int)img->width || y1 < 0 || y0 >= (int)img->height)
         return;
 
     if (y0 < 0)
         y0 = 0;
-    if (y1 >= img->height)
+    if (y1 >= (int)img->height)
         y1 = img->height - 1;
 
-    for(int y = y0; y <= y1; y++)
-        pbImagePSet(img, x, y, col);
+    int pm = img->format == pbFormatPremultiplied;
+    if (pm)
+        col = premultiply_pixel(col);
+    int *p = pixel_at(img, x, y0);
+    for (int y = y0; y <= y1; y++, p += img->stride)
+        *p = pm ? blend_pixel_pm(*p, col) : blend_pixel(*p, col);
+    pbImageTouchRect(img, x, y0, 1, y1 - y0 + 1);
 }
 
 static inline void hline(pbImage *img, int y, int x0, int x1, int col) {
@@ -581,16 +1962,22 @@ static inline void hline(pbImage *img, int y, int x0, int x1, int col) {
         x0 -= x1;
     }
 
-    if (y < 0 || y >= img->height || x0 >= img->width)
+    if (y < 0 || y >= (int)img->height || x1 < 0 || x0 >= (int)img->width)
         return;
 
     if (x0 < 0)
         x0 = 0;
-    if (x1 >= img->width)
+    if (x1 >= (int)img->width)
         x1 = img->width - 1;
 
-    for(int x = x0; x <= x1; x++)
-        pbImagePSet(img, x, y, col);
+    int a = rgbA(col);
+    if (a == 255 || a == 0)
+        fill_span(pixel_at(img, x0, y), a ? col : 0, x1 - x0 + 1);
+    else if (img->format == pbFormatPremultiplied)
+        blend_fill_span_pm(pixel_at(img, x0, y), premultiply_pixel(col), x1 - x0 + 1);
+    else
+        blend_fill_span(pixel_at(img, x0, y), col, x1 - x0 + 1);
+    pbImageTouchRect(img, x0, y, x1 - x0 + 1, 1);
 }
 
 void pbImageDrawLine(pbImage *img, int x0, int y0, int x1, int y1, int col) {
@@ -602,8 +1989,9 @@ void pbImageDrawLine(pbImage *img, int x0, int y0, int x1, int y1, int col) {
         int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
         int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
         int err = (dx > dy ? dx : -dy) / 2;
+        pbImageTouchRect(img, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, dx + 1, dy + 1);
 
-        while (pbImagePSet(img, x0, y0, col), x0 != x1 || y0 != y1) {
+        while (pset(img, x0, y0, col), x0 != x1 || y0 != y1) {
             int e2 = err;
             if (e2 > -dx) { err -= dy; x0 += sx; }
             if (e2 <  dy) { err += dx; y0 += sy; }
@@ -612,12 +2000,13 @@ void pbImageDrawLine(pbImage *img, int x0, int y0, int x1, int y1, int col) {
 }
 
 void pbImageDrawCircle(pbImage *img, int xc, int yc, int r, int col, int fill) {
+    pbImageTouchRect(img, xc - r, yc - r, r * 2 + 1, r * 2 + 1);
     int x = -r, y = 0, err = 2 - 2 * r; /* II. Quadrant */
     do {
-        pbImagePSet(img, xc - x, yc + y, col);    /*   I. Quadrant */
-        pbImagePSet(img, xc - y, yc - x, col);    /*  II. Quadrant */
-        pbImagePSet(img, xc + x, yc - y, col);    /* III. Quadrant */
-        pbImagePSet(img, xc + y, yc + x, col);    /*  IV. Quadrant */
+        pset(img, xc - x, yc + y, col);    /*   I. Quadrant */
+        pset(img, xc - y, yc - x, col);    /*  II. Quadrant */
+        pset(img, xc + x, yc - y, col);    /* III. Quadrant */
+        pset(img, xc + y, yc + x, col);    /*  IV. Quadrant */
 
         if (fill) {
             hline(img, yc - y, xc - x, xc + x, col);
@@ -688,7 +2077,7 @@ void pbImageDrawTriangle(pbImage *img, int x0, int y0, int x1, int y1, int x2, i
             __SWAP(y1, y2);
         }
 
-        int total_height = y2 - y0, i, j;
+        int total_height = y2 - y0, i;
         for (i = 0; i < total_height; ++i) {
             int second_half = i > y1 - y0 || y1 == y0;
             int segment_height = second_half ? y2 - y1 : y1 - y0;
@@ -702,8 +2091,7 @@ void pbImageDrawTriangle(pbImage *img, int x0, int y0, int x1, int y1, int x2, i
                 __SWAP(ax, bx);
                 __SWAP(ay, by);
             }
-            for (j = ax; j <= bx; ++j)
-                pbImagePSet(img, j, y0 + i, col);
+            hline(img, y0 + i, ax, bx, col);
         }
     } else {
         pbImageDrawLine(img, x0, y0, x1, y1, col);
@@ -855,10 +2243,22 @@ static char font8x8_basic[128][8] = {
 };
 
 void pbImageDrawCharacter(pbImage *img, char c, int x, int y, int col) {
-    char *bitmap = font8x8_basic[(int)c];
-    for (int i = 0; i < 8; i++)
-        for (int j = 0; j < 8; j++)
-            pbImagePSet(img, x + i, y + j, bitmap[j] & 1 << i ? col : 0xFF000000);
+    char *bitmap = font8x8_basic[c & 0x7F];
+    int x0 = __MAX(0, -x), x1 = __MIN(8, (int)img->width - x);
+    if (x0 >= x1)
+        return;
+    int pm = img->format == pbFormatPremultiplied;
+    if (pm)
+        col = premultiply_pixel(col);
+    int row[8];
+    for (int j = 0; j < 8; j++) {
+        if (y + j < 0 || y + j >= img->height)
+            continue;
+        for (int i = x0; i < x1; i++)
+            row[i] = bitmap[j] & 1 << i ? col : 0xFF000000;
+        (pm ? blend_span_pm : blend_span)(pixel_at(img, x + x0, y + j), row + x0, x1 - x0);
+    }
+    pbImageTouchRect(img, x + x0, y, x1 - x0, 8);
 }
 
 void pbImageDrawString(pbImage *img, const char *str, int x, int y, int col) {
@@ -954,17 +2354,61 @@ pbImage* pbImageLoadFromMemory(const void *data, size_t length) {
     assert(in && _w && _h);
 
     pbImage *result = pbImageNew(_w, _h);
-    for (int x = 0; x < _w; x++)
-        for (int y = 0; y < _h; y++) {
+    if (!result) {
+        free(in);
+        return NULL;
+    }
+    for (int y = 0; y < _h; y++) {
+        int *row = pixel_at(result, 0, y);
+        for (int x = 0; x < _w; x++) {
             unsigned char *p = in + (x + _w * y) * 4;
-            result->buffer[y * _w + x] = RGBA(p[0], p[1], p[2], p[3]);
+            row[x] = RGBA(p[0], p[1], p[2], p[3]);
         }
+    }
     free(in);
     return result;
 }
 
 int pbImageSave(pbImage *img, const char *path) {
-    return -1; // TODO
+    const char *ext = path ? file_extension(path) : NULL;
+    if (!img || !img->buffer || !ext)
+        return -1;
+    char lower[8] = {0};
+    for (int i = 0; ext[i] && i < sizeof(lower) - 1; i++)
+        lower[i] = ext[i] >= 'A' && ext[i] <= 'Z' ? ext[i] + 32 : ext[i];
+
+    unsigned char *out = malloc(img->width * img->height * 4);
+    if (!out)
+        return -1;
+    for (int y = 0; y < img->height; y++) {
+        int *row = pixel_at(img, 0, y);
+        unsigned char *p = out + (size_t)y * img->width * 4;
+        for (int x = 0; x < img->width; x++, p += 4) {
+            p[0] = Rgba(row[x]);
+            p[1] = rGba(row[x]);
+            p[2] = rgBa(row[x]);
+            p[3] = rgbA(row[x]);
+        }
+    }
+
+    int result = 0;
+    if (!strcmp(lower, "qoi"))
+        result = qoi_write(path, out, &(qoi_desc) {
+            .width = img->width,
+            .height = img->height,
+            .channels = 4,
+            .colorspace = QOI_SRGB
+        }) > 0;
+    else if (!strcmp(lower, "png"))
+        result = stbi_write_png(path, img->width, img->height, 4, out, img->width * 4);
+    else if (!strcmp(lower, "bmp"))
+        result = stbi_write_bmp(path, img->width, img->height, 4, out);
+    else if (!strcmp(lower, "tga"))
+        result = stbi_write_tga(path, img->width, img->height, 4, out);
+    else if (!strcmp(lower, "jpg") || !strcmp(lower, "jpeg"))
+        result = stbi_write_jpg(path, img->width, img->height, 4, out, 90);
+    free(out);
+    return result ? 0 : -1;
 }
 
 static struct {
@@ -973,25 +2417,70 @@ static struct {
 #undef X
     void *userdata;
     int running;
-    int *data, w, h;
+    int *data, w, h, stride;
     unsigned int windowWidth;
     unsigned int windowHeight;
     int cursorX;
     int cursorY;
+    // Backends can replace the system clock used by pbTime
+    double(*clock)(void);
+    double startTime;
+    // How late sleeps have been seen to wake up, pbSleepUntil spins for this long
+    double sleepSlack;
+    double pollBudget;
+    int coalesce;
+    struct {
+        int pending, x, y;
+        float dx, dy;
+    } motion;
+    struct {
+        pbEvent events[PB_EVENT_QUEUE_SIZE];
+        unsigned int head, tail;
+    } queue;
 } pbInternal = {0};
 
+static double system_clock(void) {
+    struct timespec ts;
+#if defined(_WIN32)
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void system_sleep(double seconds) {
+#if defined(_WIN32)
+    Sleep((unsigned long)(seconds * 1000.));
+#else
+    struct timespec ts = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (time_t)seconds) * 1e9)
+    };
+    nanosleep(&ts, NULL);
+#endif
+}
+
 int pbBeginNative(int w, int h, const char *title, pbFlags flags);
 int pbPollNative(void);
 void pbFlushNative(pbImage *buffer);
 void pbEndNative(void);
 void pbSetWindowSizeNative(unsigned int w, unsigned int h);
 void pbSetWindowTitleNative(const char *title);
+// NULL when the backend has nothing better than regular memory
+pbAllocator* pbFramebufferAllocatorNative(void);
 
 int pbBegin(unsigned int w, unsigned int h, const char *title, pbFlags flags) {
     assert(!pbInternal.running);
     pbInternal.data = (void*)0;
     pbInternal.w = 0;
     pbInternal.h = 0;
+    pbInternal.clock = NULL;
+    pbInternal.startTime = system_clock();
+    pbInternal.sleepSlack = .002;
+    pbInternal.coalesce = !!(flags & pbCoalesceMotion);
+    pbInternal.motion.pending = 0;
+    pbInternal.queue.head = pbInternal.queue.tail = 0;
     pbInternal.running = pbBeginNative(w, h, title, flags);
     return pbInternal.running;
 }
@@ -1002,6 +2491,13 @@ int pbPoll(void) {
 
 void pbFlush(pbImage *buffer) {
     pbFlushNative(buffer);
+    if (buffer)
+        pbImageClearDirty(buffer);
+}
+
+pbImage* pbFramebufferNew(unsigned int w, unsigned int h) {
+    pbAllocator *allocator = pbFramebufferAllocatorNative();
+    return allocator ? image_new(allocator, w, h) : pbImageNew(w, h);
 }
 
 void pbEnd(void) {
@@ -1030,6 +2526,49 @@ void pbCursorPosition(int *x, int *y) {
         *y = pbInternal.cursorY;
 }
 
+double pbTime(void) {
+    return pbInternal.clock ? pbInternal.clock() : system_clock() - pbInternal.startTime;
+}
+
+void pbSetPollBudget(double seconds) {
+    pbInternal.pollBudget = seconds;
+}
+
+static struct {
+    pbProfiler profiler;
+    void *userdata;
+} pbProfile = {0};
+
+void pbSetProfiler(pbProfiler profiler, void *userdata) {
+    pbProfile.profiler = profiler;
+    pbProfile.userdata = userdata;
+}
+
+void pbProfileZone(const char *name, double start, double end) {
+    if (pbProfile.profiler)
+        pbProfile.profiler(name, start, end, pbProfile.userdata);
+}
+
+void pbSleepUntil(double time) {
+    // Replacement clocks only move between frames, there is nothing to wait for
+    if (pbInternal.clock)
+        return;
+    double remaining;
+    while ((remaining = time - pbTime()) > pbInternal.sleepSlack) {
+        double start = pbTime(), asked = remaining - pbInternal.sleepSlack;
+        system_sleep(asked);
+        // Jump up to the worst wakeup seen, then slowly decay back down so a
+        // one-off hiccup doesn't leave us spinning for good
+        double late = pbTime() - start - asked;
+        if (late > pbInternal.sleepSlack)
+            pbInternal.sleepSlack = late > .02 ? .02 : late;
+        else
+            pbInternal.sleepSlack = __MAX(pbInternal.sleepSlack * .99, .0005);
+    }
+    while (pbTime() < time)
+        ;
+}
+
 #define X(NAME, ARGS) \
     void(*NAME##Callback)ARGS,
 void pbCallbacks(FWP_PB_CALLBACKS void* userdata) {
@@ -1048,10 +2587,147 @@ void pbCallbacks(FWP_PB_CALLBACKS void* userdata) {
 FWP_PB_CALLBACKS
 #undef X
 
-#define pbCallCallback(CB, ...)  \
+int pbDrainEvents(pbEvent *events, int max) {
+    unsigned int count = pbInternal.queue.tail - pbInternal.queue.head;
+    if (max <= 0 || !events)
+        return 0;
+    if (count > (unsigned int)max)
+        count = max;
+    // At most two copies, up to the end of the ring and then what wrapped around
+    unsigned int first = pbInternal.queue.head & (PB_EVENT_QUEUE_SIZE - 1);
+    unsigned int n = __MIN(count, PB_EVENT_QUEUE_SIZE - first);
+    memcpy(events, pbInternal.queue.events + first, n * sizeof(pbEvent));
+    memcpy(events + n, pbInternal.queue.events, (count - n) * sizeof(pbEvent));
+    pbInternal.queue.head += count;
+    return (int)count;
+}
+
+static void event_push(pbEvent e) {
+    // Keep the newest events, a missed key up is worse than a stale key down
+    if (pbInternal.queue.tail - pbInternal.queue.head == PB_EVENT_QUEUE_SIZE)
+        pbInternal.queue.head++;
+    e.time = pbTime();
+    pbInternal.queue.events[pbInternal.queue.tail++ & (PB_EVENT_QUEUE_SIZE - 1)] = e;
+}
+
+#define call_callback(CB, ...)   \
     if (pbInternal.CB##Callback) \
         pbInternal.CB##Callback(pbInternal.userdata, __VA_ARGS__)
 
+static void event_Keyboard(int key, int modifier, int isDown) {
+    event_push((pbEvent) {
+        .type = KeyboardEvent,
+        .keyboard = {
+            .key = key,
+            .isdown = isDown
+        },
+        .modifier = modifier
+    });
+    call_callback(Keyboard, key, modifier, isDown);
+}
+
+static void event_MouseButton(int button, int modifier, int isDown) {
+    event_push((pbEvent) {
+        .type = MouseButtonEvent,
+        .mouse = {
+            .button = button,
+            .isdown = isDown
+        },
+        .modifier = modifier
+    });
+    call_callback(MouseButton, button, modifier, isDown);
+}
+
+static void event_MouseMove(int x, int y, float dx, float dy) {
+    event_push((pbEvent) {
+        .type = MouseMoveEvent,
+        .mouse = {
+            .position = {
+                .x = x,
+                .y = y,
+                .dx = dx,
+                .dy = dy
+            }
+        }
+    });
+    call_callback(MouseMove, x, y, dx, dy);
+}
+
+static void event_MouseScroll(float dx, float dy, int modifier) {
+    event_push((pbEvent) {
+        .type = MouseScrollEvent,
+        .mouse = {
+            .wheel = {
+                .dx = dx,
+                .dy = dy
+            }
+        },
+        .modifier = modifier
+    });
+    call_callback(MouseScroll, dx, dy, modifier);
+}
+
+static void event_Resized(int w, int h) {
+    event_push((pbEvent) {
+        .type = ResizedEvent,
+        .window = {
+            .size = {
+                .width = w,
+                .height = h
+            }
+        }
+    });
+    call_callback(Resized, w, h);
+}
+
+static void event_Focus(int isFocused) {
+    event_push((pbEvent) {
+        .type = FocusEvent,
+        .window = {
+            .focused = isFocused
+        }
+    });
+    call_callback(Focus, isFocused);
+}
+
+static void event_Closed(void) {
+    event_push((pbEvent) {
+        .type = ClosedEvent,
+        .window = {
+            .closed = 1
+        }
+    });
+    if (pbInternal.ClosedCallback)
+        pbInternal.ClosedCallback(pbInternal.userdata);
+}
+
+// Backends report events through this, they're queued for pbDrainEvents
+// and passed to the callback straight away if there is one
+#define pbCallCallback(CB, ...) event_##CB(__VA_ARGS__)
+
+// Backends report pointer motion through these so it can be coalesced. Any
+// pending motion has to be sent before other events to keep them in order
+static void motion_flush(void) {
+    if (!pbInternal.motion.pending)
+        return;
+    pbInternal.motion.pending = 0;
+    pbCallCallback(MouseMove, pbInternal.motion.x, pbInternal.motion.y, pbInternal.motion.dx, pbInternal.motion.dy);
+}
+
+static void motion_event(int x, int y, float dx, float dy) {
+    if (!pbInternal.coalesce) {
+        pbCallCallback(MouseMove, x, y, dx, dy);
+        return;
+    }
+    if (!pbInternal.motion.pending)
+        pbInternal.motion.dx = pbInternal.motion.dy = 0.f;
+    pbInternal.motion.pending = 1;
+    pbInternal.motion.x = x;
+    pbInternal.motion.y = y;
+    pbInternal.motion.dx += dx;
+    pbInternal.motion.dy += dy;
+}
+
 void pbUserdata(void *userdata) {
     pbInternal.userdata = userdata;
 }
@@ -186,8 +186,7 @@ static NSUInteger applicationShouldTerminate(id self, SEL _sel, id sender) {
 }
 
 static void windowWillClose(id self, SEL _sel, id notification) {
-    if (pbInternal.ClosedCallback)
-        pbInternal.ClosedCallback(pbInternal.userdata);
+    event_Closed();
     pbInternal.running = 0;
 }
 
@@ -224,8 +223,8 @@ static void drawRect(id self, SEL _self, CGRect rect) {
         return;
     CGContextRef ctx = (CGContextRef)ObjC(id)(ObjC(id)(class(NSGraphicsContext), sel(currentContext)), sel(CGContext));
     CGColorSpaceRef s = CGColorSpaceCreateDeviceRGB();
-    CGDataProviderRef p = CGDataProviderCreateWithData(NULL, pbInternal.data, pbInternal.w * pbInternal.h * 4, NULL);
-    CGImageRef img = CGImageCreate(pbInternal.w, pbInternal.h, 8, 32, pbInternal.w * 4, s, kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little, p, NULL, 0, kCGRenderingIntentDefault);
+    CGDataProviderRef p = CGDataProviderCreateWithData(NULL, pbInternal.data, pbInternal.stride * pbInternal.h * 4, NULL);
+    CGImageRef img = CGImageCreate(pbInternal.w, pbInternal.h, 8, 32, pbInternal.stride * 4, s, kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little, p, NULL, 0, kCGRenderingIntentDefault);
     CGRect wh = ObjC_Struct(CGRect)(self, sel(frame));
     CGContextDrawImage(ctx, CGRectMake(0, 0, wh.size.width, wh.size.height), img);
     CGColorSpaceRelease(s);
@@ -731,6 +730,7 @@ void pbFlushNative(pbImage *buffer) {
     pbInternal.data = buffer->buffer;
     pbInternal.w = buffer->width;
     pbInternal.h = buffer->height;
+    pbInternal.stride = buffer->stride;
     ObjC(void, BOOL)(ObjC(id)(pbMacInternal.window, sel(contentView)), sel(setNeedsDisplay:), YES);
 }
 
@@ -754,3 +754,7 @@ void pbSetWindowTitleNative(const char *title) {
         ObjC(void, id)(pbMacInternal.window, sel(setTitle:), titleStr);
     });
 }
+
+pbAllocator* pbFramebufferAllocatorNative(void) {
+    return NULL;
+}
@@ -137,26 +137,28 @@ void pbFlushNative(pbImage *buffer) {
         var w = $0;
         var h = $1;
         var buf = $2;
-        var src = buf >> 2;
+        var stride = $3;
         var canvas = document.getElementById("canvas");
         var ctx = canvas.getContext("2d");
         var img = ctx.createImageData(w, h);
         var data = img.data;
 
         var i = 0;
-        var j = data.length;
-        while (i < j) {
-            var val = HEAP32[src];
-            data[i+0] = (val >> 16) & 0xFF;
-            data[i+1] = (val >> 8) & 0xFF;
-            data[i+2] = val & 0xFF;
-            data[i+3] = 0xFF;
-            src++;
-            i += 4;
+        for (var y = 0; y < h; y++) {
+            var src = (buf >> 2) + y * stride;
+            for (var x = 0; x < w; x++) {
+                var val = HEAP32[src];
+                data[i+0] = (val >> 16) & 0xFF;
+                data[i+1] = (val >> 8) & 0xFF;
+                data[i+2] = val & 0xFF;
+                data[i+3] = 0xFF;
+                src++;
+                i += 4;
+            }
         }
 
         ctx.putImageData(img, 0, 0);
-    }, buffer->width, buffer->height, buffer->buffer);
+    }, buffer->width, buffer->height, buffer->buffer, buffer->stride);
 }
 
 void pbEndNative(void) {
@@ -172,3 +174,7 @@ void pbSetWindowSizeNative(unsigned int w, unsigned int h) {
 void pbSetWindowTitleNative(const char *title) {
     emscripten_set_window_title(title);
 }
+
+pbAllocator* pbFramebufferAllocatorNative(void) {
+    return NULL;
+}
@@ -0,0 +1,235 @@
+/* pb_headless.c -- https://github.com/takeiteasy/fun-with-pixels
+
+ fun-with-pixels
+
+ Copyright (C) 2024  George Watson
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+// Backend without a display, for running scenes on machines without one.
+// Configured through the environment:
+//   PB_HEADLESS_FRAMES  Stop after this many frames [default: run until closed]
+//   PB_HEADLESS_FPS     Frames per second of simulated time [default: 60]
+//   PB_HEADLESS_EVENTS  Script of input events to replay, one per line:
+//                         <frame> key <key> <mod> <down>
+//                         <frame> button <button> <mod> <down>
+//                         <frame> move <x> <y>
+//                         <frame> scroll <dx> <dy> <mod>
+//                         <frame> resize <w> <h>
+//                         <frame> focus <focused>
+//                         <frame> close
+//   PB_HEADLESS_DUMP    printf pattern frames are written to as PPM,
+//                       e.g. "frames/%05d.ppm"
+//   PB_HEADLESS_HASH    Print a hash of the last frame on exit when set
+
+#define FWP_PB_IMPLEMENTATION
+#include "pb.h"
+
+typedef enum {
+    HeadlessKey,
+    HeadlessButton,
+    HeadlessMove,
+    HeadlessScroll,
+    HeadlessResize,
+    HeadlessFocus,
+    HeadlessClose
+} HeadlessEventType;
+
+typedef struct {
+    int frame;
+    // Position in the script, keeps events on the same frame in order
+    int line;
+    HeadlessEventType type;
+    float args[3];
+} HeadlessEvent;
+
+static struct {
+    // Read by pbTime, which may be called from other threads
+    atomic_int frame;
+    int frameLimit;
+    double fps;
+    HeadlessEvent *events;
+    int eventCount, nextEvent;
+    const char *dump;
+    int flushed;
+    int *last;
+    unsigned int lastW, lastH;
+} pbHeadlessInternal = {0};
+
+static int compare_events(const void *a, const void *b) {
+    const HeadlessEvent *ea = (const HeadlessEvent*)a, *eb = (const HeadlessEvent*)b;
+    // qsort isn't stable
+    return ea->frame != eb->frame ? ea->frame - eb->frame : ea->line - eb->line;
+}
+
+static int load_events(const char *path) {
+    FILE *fh = fopen(path, "r");
+    if (!fh)
+        return 0;
+    static const char *names[] = { "key", "button", "move", "scroll", "resize", "focus", "close" };
+    char line[256], name[32];
+    int capacity = 0;
+    while (fgets(line, sizeof(line), fh)) {
+        HeadlessEvent e = {0};
+        if (line[0] == '#' || sscanf(line, "%d %31s %f %f %f", &e.frame, name, &e.args[0], &e.args[1], &e.args[2]) < 2)
+            continue;
+        int type = -1;
+        for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+            if (!strcmp(name, names[i]))
+                type = i;
+        if (type < 0)
+            continue;
+        e.type = (HeadlessEventType)type;
+        e.line = pbHeadlessInternal.eventCount;
+        if (pbHeadlessInternal.eventCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            pbHeadlessInternal.events = realloc(pbHeadlessInternal.events, capacity * sizeof(HeadlessEvent));
+        }
+        pbHeadlessInternal.events[pbHeadlessInternal.eventCount++] = e;
+    }
+    fclose(fh);
+    qsort(pbHeadlessInternal.events, pbHeadlessInternal.eventCount, sizeof(HeadlessEvent), compare_events);
+    return 1;
+}
+
+static double headless_clock(void) {
+    return pbHeadlessInternal.frame < 0 ? 0. : pbHeadlessInternal.frame / pbHeadlessInternal.fps;
+}
+
+int pbBeginNative(int w, int h, const char *title, pbFlags flags) {
+    const char *env;
+    pbHeadlessInternal.frame = -1;
+    pbHeadlessInternal.frameLimit = (env = getenv("PB_HEADLESS_FRAMES")) ? atoi(env) : 0;
+    pbHeadlessInternal.fps = (env = getenv("PB_HEADLESS_FPS")) && atof(env) > 0 ? atof(env) : 60.;
+    pbHeadlessInternal.dump = getenv("PB_HEADLESS_DUMP");
+    if ((env = getenv("PB_HEADLESS_EVENTS")) && !load_events(env))
+        fprintf(stderr, "pb_headless: failed to open event script \"%s\"\n", env);
+    pbInternal.windowWidth = w;
+    pbInternal.windowHeight = h;
+    pbInternal.clock = headless_clock;
+    return 1;
+}
+
+static void dispatch(HeadlessEvent *e) {
+    if (e->type != HeadlessMove)
+        motion_flush();
+    switch (e->type) {
+        case HeadlessKey:
+            pbCallCallback(Keyboard, (int)e->args[0], (int)e->args[1], (int)e->args[2]);
+            break;
+        case HeadlessButton:
+            pbCallCallback(MouseButton, (int)e->args[0], (int)e->args[1], (int)e->args[2]);
+            break;
+        case HeadlessMove: {
+            int x = (int)e->args[0], y = (int)e->args[1];
+            motion_event(x, y, (float)(x - pbInternal.cursorX), (float)(y - pbInternal.cursorY));
+            pbInternal.cursorX = x;
+            pbInternal.cursorY = y;
+            break;
+        }
+        case HeadlessScroll:
+            pbCallCallback(MouseScroll, e->args[0], e->args[1], (int)e->args[2]);
+            break;
+        case HeadlessResize:
+            pbInternal.windowWidth = (unsigned int)e->args[0];
+            pbInternal.windowHeight = (unsigned int)e->args[1];
+            pbCallCallback(Resized, (int)e->args[0], (int)e->args[1]);
+            break;
+        case HeadlessFocus:
+            pbCallCallback(Focus, (int)e->args[0]);
+            break;
+        case HeadlessClose:
+            event_Closed();
+            pbInternal.running = 0;
+            break;
+    }
+}
+
+int pbPollNative(void) {
+    if (!pbInternal.running)
+        return 0;
+    pbHeadlessInternal.frame++;
+    if (pbHeadlessInternal.frameLimit > 0 && pbHeadlessInternal.frame >= pbHeadlessInternal.frameLimit)
+        return pbInternal.running = 0;
+    while (pbHeadlessInternal.nextEvent < pbHeadlessInternal.eventCount &&
+           pbHeadlessInternal.events[pbHeadlessInternal.nextEvent].frame <= pbHeadlessInternal.frame)
+        dispatch(&pbHeadlessInternal.events[pbHeadlessInternal.nextEvent++]);
+    motion_flush();
+    return pbInternal.running;
+}
+
+static void dump_frame(pbImage *buffer, int index) {
+    char path[1024];
+    snprintf(path, sizeof(path), pbHeadlessInternal.dump, index);
+    FILE *fh = fopen(path, "wb");
+    if (!fh)
+        return;
+    fprintf(fh, "P6\n%u %u\n255\n", buffer->width, buffer->height);
+    unsigned char *row = malloc(buffer->width * 3);
+    for (int y = 0; y < buffer->height; y++) {
+        int *src = buffer->buffer + (size_t)y * buffer->stride;
+        for (int x = 0; x < buffer->width; x++) {
+            row[x * 3 + 0] = Rgba(src[x]);
+            row[x * 3 + 1] = rGba(src[x]);
+            row[x * 3 + 2] = rgBa(src[x]);
+        }
+        fwrite(row, 3, buffer->width, fh);
+    }
+    free(row);
+    fclose(fh);
+}
+
+void pbFlushNative(pbImage *buffer) {
+    if (!buffer || !buffer->buffer || !buffer->width || !buffer->height)
+        return;
+    // Keep a copy of the frame as it was presented, the scene is free to
+    // start drawing over the buffer as soon as this returns
+    if (pbHeadlessInternal.lastW != buffer->width || pbHeadlessInternal.lastH != buffer->height) {
+        pbHeadlessInternal.last = realloc(pbHeadlessInternal.last, sizeof(int) * buffer->width * buffer->height);
+        pbHeadlessInternal.lastW = buffer->width;
+        pbHeadlessInternal.lastH = buffer->height;
+    }
+    for (int y = 0; y < buffer->height; y++)
+        memcpy(pbHeadlessInternal.last + y * buffer->width, buffer->buffer + (size_t)y * buffer->stride, sizeof(int) * buffer->width);
+    if (pbHeadlessInternal.dump)
+        dump_frame(buffer, pbHeadlessInternal.flushed);
+    pbHeadlessInternal.flushed++;
+}
+
+void pbEndNative(void) {
+    if (getenv("PB_HEADLESS_HASH") && pbHeadlessInternal.last) {
+        // FNV-1a over the last presented frame
+        unsigned int hash = 2166136261u;
+        unsigned char *p = (unsigned char*)pbHeadlessInternal.last;
+        for (size_t i = 0; i < sizeof(int) * pbHeadlessInternal.lastW * pbHeadlessInternal.lastH; i++)
+            hash = (hash ^ p[i]) * 16777619u;
+        printf("pb_headless: %d frames, last frame %ux%u hash %08x\n", pbHeadlessInternal.flushed, pbHeadlessInternal.lastW, pbHeadlessInternal.lastH, hash);
+    }
+    free(pbHeadlessInternal.last);
+    free(pbHeadlessInternal.events);
+    memset(&pbHeadlessInternal, 0, sizeof(pbHeadlessInternal));
+}
+
+void pbSetWindowSizeNative(unsigned int w, unsigned int h) {
+    pbInternal.windowWidth = w;
+    pbInternal.windowHeight = h;
+}
+
+void pbSetWindowTitleNative(const char *title) {
+    // Nothing to do here
+}
+
+pbAllocator* pbFramebufferAllocatorNative(void) {
+    return NULL;
+}
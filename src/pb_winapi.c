@@ -213,15 +213,14 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         case WM_PAINT:
             if (!pbInternal.pbo)
                 goto DEFAULT_PROC;
-            pbWinInternal.bmp->bmiHeader.biWidth = pbInternal.w;
+            pbWinInternal.bmp->bmiHeader.biWidth = pbInternal.stride;
             pbWinInternal.bmp->bmiHeader.biHeight = -pbInternal.h;
             StretchDIBits(pbWinInternal.hdc, 0, 0, pbInternal.windowWidth, pbInternal.windowHeight, 0, 0, pbInternal.w, pbInternal.h, pbInternal.data, pbWinInternal.bmp, DIB_RGB_COLORS, SRCCOPY);
             ValidateRect(hWnd, NULL);
             break;
         case WM_DESTROY:
         case WM_CLOSE:
-            if (pbInternal.ClosedCallback)
-                pbInternal.ClosedCallback(pbInternal.userdata);
+            event_Closed();
             pbInternal.running = 0;
             break;
         case WM_SIZE:
@@ -435,6 +434,7 @@ void pbFlushNative(pbImage *buffer) {
     pbInternal.data = buffer->buffer;
     pbInternal.w = buffer->width;
     pbInternal.h = buffer->height;
+    pbInternal.stride = buffer->stride;
     InvalidateRect(pbWinInternal.hwnd, NULL, 1);
     SendMessage(pbWinInternal.hwnd, WM_PAINT, 0, 0);
 }
@@ -455,3 +455,7 @@ void pbSetWindowSizeNative(unsigned int w, unsigned int h) {
 void pbSetWindowTitleNative(const char *title) {
     SetWindowText(state.hwnd, title);
 }
+
+pbAllocator* pbFramebufferAllocatorNative(void) {
+    return NULL;
+}
@@ -27,8 +27,15 @@
 #include <X11/keysymdef.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <stdlib.h>
 
+#ifndef PB_SHM_SEGMENTS
+#define PB_SHM_SEGMENTS 8
+#endif
+
 static struct {
     Display *display;
     Window root, window;
@@ -38,7 +45,21 @@ static struct {
     Atom delete;
     GC gc;
     XImage *img, *scaler;
+    // Source column for every scaled column, rebuilt when either size changes
+    int *columns;
+    int scaledW, scaledH, sourceW, sourceH;
     int cursorLastX, cursorLastY;
+    // pbFlush can be on another thread than pbPoll (pbThreadedFlush), what it
+    // needs from the event loop is passed through these. The window size is
+    // packed into one word as width << 16 | height
+    atomic_int exposed;
+    atomic_uint presentSize;
+    // MIT-SHM, framebuffers from pbFramebufferNew live in these segments
+    int shm, shmCompletion, shmPending, shmFailed;
+    pbAllocator shmAllocator;
+    XShmSegmentInfo segments[PB_SHM_SEGMENTS];
+    XImage *shmImages[PB_SHM_SEGMENTS];
+    int threaded;
 } pbLinuxInternal = {0};
 
 struct Hints {
@@ -49,7 +70,17 @@ struct Hints {
     unsigned long status;
 };
 
+static void window_size(int w, int h) {
+    pbInternal.windowWidth = w;
+    pbInternal.windowHeight = h;
+    atomic_store(&pbLinuxInternal.presentSize, (unsigned int)w << 16 | (h & 0xFFFF));
+}
+
 int pbBeginNative(int w, int h, const char *title, pbFlags flags) {
+    // Completion events could end up in the wrong thread's XNextEvent, so
+    // threaded flushes wait for the server with XSync instead
+    if ((pbLinuxInternal.threaded = !!(flags & pbThreadedFlush)))
+        XInitThreads();
     if (!(pbLinuxInternal.display = XOpenDisplay(NULL)))
         return 0;
     pbLinuxInternal.root   = DefaultRootWindow(pbLinuxInternal.display);
@@ -93,8 +124,7 @@ int pbBeginNative(int w, int h, const char *title, pbFlags flags) {
     swa.backing_store = NotUseful;
     if (!(pbLinuxInternal.window = XCreateWindow(pbLinuxInternal.display, pbLinuxInternal.root, x, y, w, h, 0, pbLinuxInternal.depth, InputOutput, visual, CWBackPixel | CWBorderPixel | CWBackingStore, &swa)))
         return 0;
-    pbInternal.windowWidth = w;
-    pbInternal.windowHeight = h;
+    window_size(w, h);
 
     pbLinuxInternal.delete = XInternAtom(pbLinuxInternal.display, "WM_DELETE_WINDOW", False);
     XSetWMProtocols(pbLinuxInternal.display, pbLinuxInternal.window, &pbLinuxInternal.delete, 1);
@@ -141,6 +171,14 @@ int pbBeginNative(int w, int h, const char *title, pbFlags flags) {
     pbLinuxInternal.gc = DefaultGC(pbLinuxInternal.display, pbLinuxInternal.screen);
     pbLinuxInternal.img = XCreateImage(pbLinuxInternal.display, CopyFromParent, pbLinuxInternal.depth, ZPixmap, 0, NULL, w, h, 32, w * 4);
 
+    int major, minor;
+    Bool pixmaps;
+    // Only local connections can attach shared memory, remote ones report
+    // the extension but fail on XShmAttach, which shm_alloc catches
+    if (XShmQueryVersion(pbLinuxInternal.display, &major, &minor, &pixmaps)) {
+        pbLinuxInternal.shm = 1;
+        pbLinuxInternal.shmCompletion = XShmGetEventBase(pbLinuxInternal.display) + ShmCompletion;
+    }
     return 1;
 }
 
@@ -348,10 +386,114 @@ static int ConvertX11ModEx(int key, int state, int is_pressed) {
     return mod_keys;
 }
 
+static int shm_error(Display *display, XErrorEvent *e) {
+    pbLinuxInternal.shmFailed = 1;
+    return 0;
+}
+
+static XShmSegmentInfo* shm_segment(void *ptr) {
+    for (int i = 0; i < PB_SHM_SEGMENTS; i++)
+        if (pbLinuxInternal.segments[i].shmaddr == ptr)
+            return &pbLinuxInternal.segments[i];
+    return NULL;
+}
+
+static void* shm_alloc(pbAllocator *allocator, size_t size) {
+    XShmSegmentInfo *seg = shm_segment(NULL);
+    if (!pbLinuxInternal.shm || !seg)
+        return NULL;
+    if ((seg->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600)) < 0)
+        return NULL;
+    if ((seg->shmaddr = shmat(seg->shmid, NULL, 0)) == (char*)-1) {
+        shmctl(seg->shmid, IPC_RMID, NULL);
+        seg->shmaddr = NULL;
+        return NULL;
+    }
+    seg->readOnly = False;
+
+    pbLinuxInternal.shmFailed = 0;
+    XErrorHandler old = XSetErrorHandler(shm_error);
+    XShmAttach(pbLinuxInternal.display, seg);
+    XSync(pbLinuxInternal.display, False);
+    XSetErrorHandler(old);
+    // The segment goes away by itself once both sides have detached
+    shmctl(seg->shmid, IPC_RMID, NULL);
+    if (pbLinuxInternal.shmFailed) {
+        pbLinuxInternal.shm = 0;
+        shmdt(seg->shmaddr);
+        seg->shmaddr = NULL;
+        return NULL;
+    }
+    return seg->shmaddr;
+}
+
+static Bool is_shm_completion(Display *display, XEvent *e, XPointer arg) {
+    return e->type == pbLinuxInternal.shmCompletion;
+}
+
+// The server reads straight out of the framebuffer, so nothing may touch it
+// until the last XShmPutImage has finished
+static void shm_wait(void) {
+    XEvent e;
+    if (pbLinuxInternal.shmPending)
+        XIfEvent(pbLinuxInternal.display, &e, is_shm_completion, NULL);
+    pbLinuxInternal.shmPending = 0;
+}
+
+static void shm_release(pbAllocator *allocator, void *ptr, size_t size) {
+    XShmSegmentInfo *seg = shm_segment(ptr);
+    if (!seg)
+        return;
+    shm_wait();
+    XImage **img = &pbLinuxInternal.shmImages[seg - pbLinuxInternal.segments];
+    if (*img) {
+        (*img)->data = NULL;
+        XDestroyImage(*img);
+        *img = NULL;
+    }
+    XShmDetach(pbLinuxInternal.display, seg);
+    XSync(pbLinuxInternal.display, False);
+    shmdt(seg->shmaddr);
+    seg->shmaddr = NULL;
+}
+
+pbAllocator* pbFramebufferAllocatorNative(void) {
+    if (!pbLinuxInternal.shm)
+        return NULL;
+    pbLinuxInternal.shmAllocator.alloc = shm_alloc;
+    pbLinuxInternal.shmAllocator.release = shm_release;
+    return &pbLinuxInternal.shmAllocator;
+}
+
+static XImage* shm_image(pbImage *buffer) {
+    XShmSegmentInfo *seg = shm_segment(buffer);
+    if (!seg)
+        return NULL;
+    XImage **img = &pbLinuxInternal.shmImages[seg - pbLinuxInternal.segments];
+    if (!*img) {
+        Visual *visual = DefaultVisual(pbLinuxInternal.display, pbLinuxInternal.screen);
+        // XShmPutImage takes the row length from the image width, so the padding
+        // at the end of each row is made part of the image
+        *img = XShmCreateImage(pbLinuxInternal.display, visual, pbLinuxInternal.depth, ZPixmap, (char*)buffer->buffer, seg, buffer->stride, buffer->height);
+    }
+    return *img;
+}
+
+static int poll_budget_spent(double start) {
+    return pbInternal.pollBudget > 0 && pbTime() - start >= pbInternal.pollBudget;
+}
+
 int pbPollNative(void) {
     XEvent e;
-    while (pbInternal.running && XPending(pbLinuxInternal.display)) {
+    shm_wait();
+    // Waiting on the server above doesn't count against the budget
+    double start = pbTime();
+    for (int handled = 0; pbInternal.running && XPending(pbLinuxInternal.display); handled++) {
+        if (handled && poll_budget_spent(start))
+            break;
         XNextEvent(pbLinuxInternal.display, &e);
+        if (e.type != MotionNotify)
+            motion_flush();
         switch (e.type) {
             case KeyPress:
             case KeyRelease:
@@ -389,7 +531,7 @@ int pbPollNative(void) {
             case MotionNotify: {
                 int cx = e.xmotion.x;
                 int cy = e.xmotion.y;
-                pbCallCallback(MouseMove, cx, cy, cx - pbLinuxInternal.cursorLastX, cy - pbLinuxInternal.cursorLastY);
+                motion_event(cx, cy, cx - pbLinuxInternal.cursorLastX, cy - pbLinuxInternal.cursorLastY);
                 pbLinuxInternal.cursorLastX = cx;
                 pbLinuxInternal.cursorLastY = cy;
                 break;
@@ -400,79 +542,134 @@ int pbPollNative(void) {
                 if (pbInternal.windowWidth == w && pbInternal.windowHeight == h)
                     break;
                 pbCallCallback(Resized, w, h);
-                pbInternal.windowWidth = w;
-                pbInternal.windowHeight = h;
+                window_size(w, h);
 
-                if (pbLinuxInternal.scaler) {
-                    pbLinuxInternal.scaler->data = NULL;
-                    XDestroyImage(pbLinuxInternal.scaler);
-                    pbLinuxInternal.scaler = NULL;
-                }
                 XClearWindow(pbLinuxInternal.display, pbLinuxInternal.window);
+                atomic_store(&pbLinuxInternal.exposed, 1);
                 break;
             }
+            case Expose:
+                atomic_store(&pbLinuxInternal.exposed, 1);
+                break;
             case ClientMessage:
                 if (e.xclient.data.l[0] != pbLinuxInternal.delete)
                     break;
+                // fall through
+            case DestroyNotify:
+                event_Closed();
                 pbInternal.running = 0;
                 break;
         }
     }
+    motion_flush();
     return pbInternal.running;
 }
 
-static int* scale(int *data, int w, int h, int nw, int nh) {
-    assert(data && w && h && nw && nh);
-    assert(!(w == nw && h == nh));
-    int *result = malloc(sizeof(int) * nw * nh);
+static void scaler_free(void) {
+    if (pbLinuxInternal.scaler) {
+        pbLinuxInternal.scaler->data = NULL;
+        XDestroyImage(pbLinuxInternal.scaler);
+        pbLinuxInternal.scaler = NULL;
+    }
+    if (pbLinuxInternal.buffer)
+        free(pbLinuxInternal.buffer);
+    if (pbLinuxInternal.columns)
+        free(pbLinuxInternal.columns);
+    pbLinuxInternal.buffer = pbLinuxInternal.columns = NULL;
+}
+
+static int scaler_resize(int w, int h, int nw, int nh) {
+    if (pbLinuxInternal.scaler && pbLinuxInternal.sourceW == w && pbLinuxInternal.sourceH == h &&
+        pbLinuxInternal.scaledW == nw && pbLinuxInternal.scaledH == nh)
+        return 1;
+    scaler_free();
+    if (!(pbLinuxInternal.buffer = malloc(sizeof(int) * nw * nh)) ||
+        !(pbLinuxInternal.columns = malloc(sizeof(int) * nw))) {
+        scaler_free();
+        return 0;
+    }
+    pbLinuxInternal.scaler = XCreateImage(pbLinuxInternal.display, CopyFromParent, pbLinuxInternal.depth, ZPixmap, 0, (char*)pbLinuxInternal.buffer, nw, nh, 32, nw * 4);
     int x_ratio = (int)((w << 16) / nw) + 1;
+    for (int j = 0, rat = 0; j < nw; j++, rat += x_ratio)
+        pbLinuxInternal.columns[j] = rat >> 16;
+    pbLinuxInternal.sourceW = w;
+    pbLinuxInternal.sourceH = h;
+    pbLinuxInternal.scaledW = nw;
+    pbLinuxInternal.scaledH = nh;
+    return 1;
+}
+
+static void scale(int *data, int w, int h, int stride, int nw, int nh) {
+    assert(data && w && h && nw && nh);
+    int *result = pbLinuxInternal.buffer, *columns = pbLinuxInternal.columns;
     int y_ratio = (int)((h << 16) / nh) + 1;
-    int x2, y2, i, j;
-    for (i = 0; i < nh; ++i) {
+    int factor = nw % w ? 0 : nw / w;
+    int last = -1;
+    for (int i = 0; i < nh; ++i) {
         int *t = result + i * nw;
-        y2 = ((i * y_ratio) >> 16);
-        int *p = data + y2 * w;
-        int rat = 0;
-        for (j = 0; j < nw; ++j) {
-            x2 = (rat >> 16);
-            *t++ = p[x2];
-            rat += x_ratio;
+        int y2 = (i * y_ratio) >> 16;
+        // Scaling up repeats source rows, those are just a copy of the last one
+        if (y2 == last) {
+            memcpy(t, t - nw, sizeof(int) * nw);
+            continue;
         }
+        last = y2;
+        int *p = data + y2 * stride;
+        if (factor == 1)
+            memcpy(t, p, sizeof(int) * nw);
+        else if (factor)
+            for (int j = 0; j < w; j++)
+                for (int k = 0; k < factor; k++)
+                    *t++ = p[j];
+        else
+            for (int j = 0; j < nw; j++)
+                t[j] = p[columns[j]];
     }
-    return result;
 }
 
 void pbFlushNative(pbImage *buffer) {
     if (!buffer || !buffer->buffer || !buffer->width || !buffer->height)
         return;
-    if (pbInternal.windowWidth != buffer->width || pbInternal.windowHeight != buffer->height) {
-        if (pbLinuxInternal.scaler) {
-            pbLinuxInternal.scaler->data = NULL;
-            XDestroyImage(pbLinuxInternal.scaler);
-            pbLinuxInternal.scaler = NULL;
+    unsigned int size = atomic_load(&pbLinuxInternal.presentSize);
+    unsigned int ww = size >> 16, wh = size & 0xFFFF;
+    // Cleared before drawing so an expose that comes in meanwhile isn't lost
+    int exposed = atomic_exchange(&pbLinuxInternal.exposed, 0);
+    if (ww != buffer->width || wh != buffer->height) {
+        if (!scaler_resize(buffer->width, buffer->height, ww, wh))
+            return;
+        scale(buffer->buffer, buffer->width, buffer->height, buffer->stride, ww, wh);
+        XPutImage(pbLinuxInternal.display, pbLinuxInternal.window, pbLinuxInternal.gc, pbLinuxInternal.scaler, 0, 0, 0, 0, ww, wh);
+    } else {
+        XImage *shm = buffer->allocator == &pbLinuxInternal.shmAllocator ? shm_image(buffer) : NULL;
+        XImage *img = shm ? shm : pbLinuxInternal.img;
+        if (!shm) {
+            img->data = (char*)buffer->buffer;
+            img->bytes_per_line = buffer->stride * 4;
         }
-        pbLinuxInternal.scaler = XCreateImage(pbLinuxInternal.display, CopyFromParent, pbLinuxInternal.depth, ZPixmap, 0, NULL, pbInternal.windowWidth, pbInternal.windowHeight, 32, pbInternal.windowWidth * 4);
 
-        if (pbLinuxInternal.buffer)
-            free(pbLinuxInternal.buffer);
-        pbLinuxInternal.buffer = scale(buffer->data, buffer->width, buffer->height, pbInternal.windowWidth, pbInternal.windowHeight);
-        pbLinuxInternal.scaler->data = (char*)pbLinuxInternal.buffer;
-        XPutImage(pbLinuxInternal.display, pbLinuxInternal.window, pbLinuxInternal.gc, pbLinuxInternal.scaler, 0, 0, 0, 0, pbInternal.windowWidth, pbInternal.windowHeight);
-    } else {
-        pbLinuxInternal.img->data = (char*)buffer->buffer;
-        XPutImage(pbLinuxInternal.display, pbLinuxInternal.window, pbLinuxInternal.gc, pbLinuxInternal.img, 0, 0, 0, 0, pbInternal.windowWidth, pbInternal.windowHeight);
+        pbRect full = { 0, 0, ww, wh }, *rects = &full;
+        int count = 1;
+        // The window contents can't be trusted after an expose, push everything
+        if (buffer->trackDirty && !exposed)
+            count = pbImageDirtyRects(buffer, &rects);
+        for (int i = 0; i < count; i++)
+            if (shm)
+                // Only the last put asks for a completion event, pbPoll waits on it
+                XShmPutImage(pbLinuxInternal.display, pbLinuxInternal.window, pbLinuxInternal.gc, shm, rects[i].x, rects[i].y, rects[i].x, rects[i].y, rects[i].w, rects[i].h, i == count - 1 && !pbLinuxInternal.threaded);
+            else
+                XPutImage(pbLinuxInternal.display, pbLinuxInternal.window, pbLinuxInternal.gc, img, rects[i].x, rects[i].y, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+        if (shm && count && pbLinuxInternal.threaded)
+            XSync(pbLinuxInternal.display, False);
+        else
+            pbLinuxInternal.shmPending = shm && count;
     }
     XFlush(pbLinuxInternal.display);
 }
 
 void pbEndNative(void) {
     assert(pbInternal.running);
-    if (pbLinuxInternal.scaler) {
-        pbLinuxInternal.scaler->data = NULL;
-        XDestroyImage(pbLinuxInternal.scaler);
-    }
-    if (pbLinuxInternal.buffer)
-        free(pbLinuxInternal.buffer);
+    shm_wait();
+    scaler_free();
     pbLinuxInternal.img->data = NULL;
     XDestroyImage(pbLinuxInternal.img);
     XDestroyWindow(pbLinuxInternal.display, pbLinuxInternal.window);
@@ -480,8 +677,7 @@ void pbEndNative(void) {
 }
 
 void pbSetWindowSizeNative(unsigned int w, unsigned int h) {
-    pbInternal.windowWidth = w;
-    pbInternal.windowHeight = h;
+    window_size(w, h);
     XResizeWindow(pbLinuxInternal.display, pbLinuxInternal.window, w, h);
 }
 
@@ -0,0 +1,56 @@
+// pbImagePSetBatch only marks the area around the points that landed,
+// and a batch where nothing landed leaves the image clean
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int frames;
+};
+
+static void batch(pbImage *img, const char *name, const int *xy, int n) {
+    int cols[64];
+    for (int i = 0; i < n; i++)
+        cols[i] = RGB(255, 4 * i, 0);
+    pbImageClearDirty(img);
+    pbImagePSetBatch(img, xy, cols, n);
+    pbRect *rects;
+    int count = pbImageDirtyRects(img, &rects);
+    printf("%s: %d", name, count);
+    for (int i = 0; i < count; i++)
+        printf(" %d,%d %dx%d", rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+    printf("\n");
+}
+
+static fwpState* init(pbImage *framebuffer) {
+    pbImage *img = pbImageNew(64, 64);
+    pbImageFill(img, RGB(0, 0, 0));
+    pbImageTrackDirty(img, 1);
+
+    int outside[18] = { -1, 0, 64, 0, 0, -1, 0, 64, -100, -100, 1000, 5, 5, 1000, 64, 64, -1, -1 };
+    batch(img, "outside", outside, 9);
+    // More than a handful of points, so any wide path is taken too
+    int some[18] = { -1, 0, 10, 20, 64, 0, 30, 5, 0, 64, 12, 40, 70, 70, 3, 33, -5, 8 };
+    batch(img, "some", some, 9);
+    int one[2] = { 63, 63 };
+    batch(img, "one", one, 1);
+
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    pbImagePaste(framebuffer, img, 0, 0);
+    pbImageFree(img);
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    free(state);
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .tick = tick
+};
@@ -0,0 +1,60 @@
+// Every kind of event reaches the scene in the order it happened, batched
+// per frame, and closing the window still delivers ClosedEvent
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int frame, count;
+};
+
+static fwpState* init(pbImage *framebuffer) {
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    printf("%d events\n", state->count);
+    free(state);
+}
+
+static int events(fwpState *state, pbEvent *e, int count) {
+    printf("frame %d: %d events\n", state->frame, count);
+    for (int i = 0; i < count; i++, state->count++)
+        switch (e[i].type) {
+            case KeyboardEvent:
+                printf("  key %d %s\n", e[i].keyboard.key, e[i].keyboard.isdown ? "down" : "up");
+                break;
+            case MouseButtonEvent:
+                printf("  button %d %s\n", e[i].mouse.button, e[i].mouse.isdown ? "down" : "up");
+                break;
+            case MouseMoveEvent:
+                printf("  move %u,%u\n", e[i].mouse.position.x, e[i].mouse.position.y);
+                break;
+            case MouseScrollEvent:
+                printf("  scroll %g,%g\n", e[i].mouse.wheel.dx, e[i].mouse.wheel.dy);
+                break;
+            case ResizedEvent:
+                printf("  resize %ux%u\n", e[i].window.size.width, e[i].window.size.height);
+                break;
+            case FocusEvent:
+                printf("  focus %d\n", e[i].window.focused);
+                break;
+            case ClosedEvent:
+                printf("  closed\n");
+                break;
+        }
+    return 1;
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    state->frame++;
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .events = events,
+    .tick = tick
+};
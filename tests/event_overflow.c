@@ -0,0 +1,38 @@
+// More events than the queue holds in one frame, the oldest are dropped and
+// the newest PB_EVENT_QUEUE_SIZE come through in order
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int frame;
+};
+
+static fwpState* init(pbImage *framebuffer) {
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    free(state);
+}
+
+static int events(fwpState *state, pbEvent *e, int count) {
+    int ordered = 1;
+    for (int i = 1; i < count; i++)
+        ordered &= e[i].keyboard.key == e[i - 1].keyboard.key + 1;
+    printf("frame %d: %d events, keys %d to %d%s\n", state->frame, count, e[0].keyboard.key, e[count - 1].keyboard.key, ordered ? "" : " out of order");
+    return 1;
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    state->frame++;
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .events = events,
+    .tick = tick
+};
@@ -0,0 +1,35 @@
+// With --fixed the scene is ticked at that rate whatever the frame rate,
+// always with the same delta, carrying what's left over to the next frame
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int ticks;
+    double total;
+};
+
+static fwpState* init(pbImage *framebuffer) {
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    printf("%d ticks, %.4fs\n", state->ticks, state->total);
+    free(state);
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    printf("%.4f: %.4f\n", pbTime(), delta);
+    // One column per tick, taller the longer the tick
+    pbImageDrawLine(framebuffer, state->ticks, 0, state->ticks, (int)(delta * 1000.), RGB(255, 255, 255));
+    state->ticks++;
+    state->total += delta;
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .tick = tick
+};
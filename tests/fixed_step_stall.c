@@ -0,0 +1,3 @@
+// Frames half a second apart, --fixed only catches up on a quarter second of
+// it each frame instead of ticking through the whole stall
+#include "fixed_step.c"
@@ -0,0 +1,60 @@
+// Pastes blend in the destination's format whatever the source's, and an
+// image drawn to directly through buffer is never mistaken for opaque
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int frames;
+};
+
+static pbImage* image(pbFormat format, int col) {
+    pbImage *img = pbImageNew(4, 4);
+    pbImageFill(img, col);
+    pbImageConvert(img, format);
+    return img;
+}
+
+static void paste(const char *name, pbFormat from, pbFormat to) {
+    pbImage *src = image(from, RGBA(255, 0, 0, 128));
+    pbImage *dst = image(to, RGB(0, 0, 255));
+    pbImagePaste(dst, src, 0, 0);
+    pbImageConvert(dst, pbFormatStraight);
+    printf("%s: %08x\n", name, (unsigned int)pbImagePGet(dst, 1, 1));
+    pbImageFree(src);
+    pbImageFree(dst);
+}
+
+static fwpState* init(pbImage *framebuffer) {
+    paste("straight onto straight", pbFormatStraight, pbFormatStraight);
+    paste("straight onto premultiplied", pbFormatStraight, pbFormatPremultiplied);
+    paste("premultiplied onto straight", pbFormatPremultiplied, pbFormatStraight);
+    paste("premultiplied onto premultiplied", pbFormatPremultiplied, pbFormatPremultiplied);
+
+    pbImage *src = image(pbFormatStraight, RGB(255, 0, 0));
+    pbImage *dst = image(pbFormatStraight, RGB(0, 0, 255));
+    pbImagePaste(dst, src, 0, 0);
+    src->buffer[src->stride + 1] = RGBA(0, 255, 0, 128);
+    pbImageFill(dst, RGB(0, 0, 255));
+    pbImagePaste(dst, src, 0, 0);
+    printf("written through buffer: %08x\n", (unsigned int)pbImagePGet(dst, 1, 1));
+    pbImageFree(src);
+    pbImageFree(dst);
+
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    free(state);
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .tick = tick
+};
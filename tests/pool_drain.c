@@ -0,0 +1,83 @@
+// Jobs the scene spawns and never waits on are finished before it's unloaded
+// (here by rewriting its own library) and before deinit
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+struct fwpState {
+    int frame, reloaded;
+    fwpTask *task;
+};
+
+// Each copy of the library counts its own jobs
+static atomic_int spawned, finished;
+
+static void job(void *userdata, int index) {
+    usleep(5000);
+    atomic_fetch_add(&finished, 1);
+}
+
+// Copy the library over itself the way a rebuild would, so fwp reloads it
+static void rebuild(void) {
+    const char *path = getenv("FWP_CHECK_SCENE");
+    char copy[1024];
+    snprintf(copy, sizeof(copy), "%s.new", path);
+    FILE *in = fopen(path, "rb"), *out = fopen(copy, "wb");
+    char buffer[4096];
+    size_t n;
+    while (in && out && (n = fread(buffer, 1, sizeof(buffer), in)))
+        fwrite(buffer, 1, n, out);
+    if (in)
+        fclose(in);
+    if (out)
+        fclose(out);
+    rename(copy, path);
+}
+
+static fwpState* init(pbImage *framebuffer) {
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    printf("deinit: %d jobs unfinished\n", atomic_load(&spawned) - atomic_load(&finished));
+    fwpWait(state->task);
+    free(state);
+}
+
+static void reload(fwpState *state) {
+    state->reloaded = 1;
+}
+
+static void unload(fwpState *state) {
+    printf("unload: %d jobs unfinished\n", atomic_load(&spawned) - atomic_load(&finished));
+    // Tasks belong to the pool, not the library, so they're waited on as usual
+    fwpWait(state->task);
+    state->task = NULL;
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    if (state->task)
+        fwpWait(state->task);
+    atomic_fetch_add(&spawned, 8);
+    state->task = fwpSpawn(8, job, NULL);
+    if (state->frame++ == 2)
+        rebuild();
+    // Plenty of time for the reload to land, stopping on a fixed frame keeps
+    // the output the same however long it took
+    if (state->frame < 30)
+        return 1;
+    if (!state->reloaded)
+        puts("never reloaded");
+    return 0;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .reload = reload,
+    .unload = unload,
+    .tick = tick
+};
@@ -0,0 +1,2 @@
+// Without --profile F3 is an ordinary key
+#include "profile_overlay.c"
@@ -0,0 +1,45 @@
+// The --profile overlay is only drawn over presented frames, the scene never
+// finds it in its framebuffer, and F3 (which toggles it) is kept from scenes
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int frame, f3, covered;
+};
+
+static fwpState* init(pbImage *framebuffer) {
+    // Drawn once, later frames build on it
+    pbImageFill(framebuffer, RGB(0, 64, 128));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    printf("f3 seen %d times, overlay found on %d frames\n", state->f3, state->covered);
+    free(state);
+}
+
+static int event(fwpState *state, pbEvent *e) {
+    if (e->type == KeyboardEvent && e->keyboard.key == KEY_F3)
+        state->f3++;
+    return 1;
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    for (int y = 0; y < 64; y++)
+        for (int x = 0; x < 64; x++)
+            if (pbImagePGet(framebuffer, x, y) != RGB(0, 64, 128)) {
+                state->covered++;
+                y = 64;
+                break;
+            }
+    pbImagePSet(framebuffer, 300 + state->frame++, 300, RGB(255, 255, 255));
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .event = event,
+    .tick = tick
+};
@@ -0,0 +1,67 @@
+// A library that fails to load is warned about once and left alone until
+// it's replaced, the working one is then picked up as usual
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct fwpState {
+    int frame;
+};
+
+// The library as it was built, written back once the broken one was seen
+static char *original;
+static size_t originalSize;
+
+static void replace(const void *data, size_t size) {
+    const char *path = getenv("FWP_CHECK_SCENE");
+    char copy[1024];
+    snprintf(copy, sizeof(copy), "%s.new", path);
+    FILE *out = fopen(copy, "wb");
+    if (!out)
+        return;
+    fwrite(data, 1, size, out);
+    fclose(out);
+    rename(copy, path);
+}
+
+static fwpState* init(pbImage *framebuffer) {
+    FILE *in = fopen(getenv("FWP_CHECK_SCENE"), "rb");
+    if (in) {
+        fseek(in, 0, SEEK_END);
+        originalSize = ftell(in);
+        fseek(in, 0, SEEK_SET);
+        if ((original = malloc(originalSize)))
+            originalSize = fread(original, 1, originalSize, in);
+        fclose(in);
+    }
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    free(state);
+}
+
+static void reload(fwpState *state) {
+    printf("reloaded on frame %s\n", state->frame > 20 ? "after 20" : "before 20");
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    // Slow enough for every failed attempt to land between the two writes
+    usleep(2000);
+    if (state->frame == 2)
+        replace("not a library", 13);
+    if (state->frame == 20) {
+        replace(original, originalSize);
+        free(original);
+    }
+    return ++state->frame < 40;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .reload = reload,
+    .tick = tick
+};
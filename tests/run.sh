@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs every scene in tests/ on the headless backend and compares what it
+# prints, along with the hash of its last frame, with tests/<name>.expected
+#   tests/<name>.events  Event script (PB_HEADLESS_EVENTS)
+#   tests/<name>.env     Extra VAR=value settings, e.g. PB_HEADLESS_FPS=30
+#   tests/<name>.args    Extra fwp options
+# Scenes can find their own library through FWP_CHECK_SCENE, paths under the
+# build directory are printed relative to it
+# Usage: tests/run.sh <directory fwp and the test scenes were built into>
+
+BUILD=${1:-build/check}
+EXT=so
+[ "$(uname -s)" = "Darwin" ] && EXT=dylib
+failed=0
+
+for source in tests/*.c; do
+    name=$(basename "$source" .c)
+    scene=$BUILD/tests/$name.$EXT
+    events=
+    [ -f "tests/$name.events" ] && events=PB_HEADLESS_EVENTS=tests/$name.events
+    output=$(env LD_LIBRARY_PATH="$BUILD" DYLD_LIBRARY_PATH="$BUILD" \
+                 PB_HEADLESS_FRAMES=60 PB_HEADLESS_HASH=1 $events \
+                 FWP_CHECK_SCENE="$scene" $(cat "tests/$name.env" 2>/dev/null) \
+                 "$BUILD/fwp" "$scene" -f 0 $(cat "tests/$name.args" 2>/dev/null) 2>&1 |
+             sed "s|$BUILD/||g")
+    if [ "$output" = "$(cat "tests/$name.expected" 2>/dev/null)" ]; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        echo "$output" | diff "tests/$name.expected" - | sed 's/^/    /'
+        failed=$((failed + 1))
+    fi
+done
+
+[ $failed -eq 0 ] || { echo "$failed failed"; exit 1; }
@@ -0,0 +1,39 @@
+// Events from a headless script arrive on their frame in the order they're
+// written, however the lines are shuffled between frames
+#include "fwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct fwpState {
+    int frame, count;
+};
+
+static fwpState* init(pbImage *framebuffer) {
+    pbImageFill(framebuffer, RGB(0, 0, 0));
+    return calloc(1, sizeof(fwpState));
+}
+
+static void deinit(fwpState *state) {
+    printf("%d events\n", state->count);
+    free(state);
+}
+
+static int event(fwpState *state, pbEvent *e) {
+    if (e->type != KeyboardEvent)
+        return 1;
+    printf("frame %d: key %d %s\n", state->frame, e->keyboard.key, e->keyboard.isdown ? "down" : "up");
+    state->count++;
+    return 1;
+}
+
+static int tick(fwpState *state, pbImage *framebuffer, double delta) {
+    state->frame++;
+    return 1;
+}
+
+const fwpScene scene = {
+    .init = init,
+    .deinit = deinit,
+    .event = event,
+    .tick = tick
+};